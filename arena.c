@@ -0,0 +1,151 @@
+// Memory of a compilation.
+//
+// Everything that lives until the end of a compilation is allocated
+// from the arena of its thread, and the compilation releases the arena
+// as a whole when it ends. A long-running process such as the compile
+// server therefore does not grow with the number of compilations it
+// has done. Allocation bumps a pointer in the current chunk. Chunks come
+// zeroed from calloc and are never reused, so neither is memory.
+//
+// Compiling a function at a time, the memory of a function comes from a
+// second, scratch arena, which is freed once the function is emitted.
+// Resizable arrays belong to the passes rather than to any function, so
+// they always come from the arena of the compilation.
+#include "ncc.h"
+
+#define CHUNK_SIZE (1 << 20)
+
+// Blocks larger than this get a chunk of their own
+#define MAX_SMALL_BLOCK (CHUNK_SIZE / 4)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    size_t pad;
+};
+
+// Every block is preceded by its size, which arena_realloc needs
+typedef struct {
+    size_t size;
+    size_t pad;
+} Header;
+
+typedef struct {
+    Chunk *chunks;
+    char *cur;
+    char *end;
+} Arena;
+
+static _Thread_local Arena unit;
+static _Thread_local Arena scratch;
+static _Thread_local bool in_scratch;
+
+static char *new_chunk(Arena *a, size_t size) {
+    Chunk *chunk = calloc(1, sizeof(Chunk) + size);
+    if (!chunk) {
+        error("out of memory");
+    }
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    return (char *)(chunk + 1);
+}
+
+static size_t block_size(size_t size) {
+    return sizeof(Header) + (size + 15) / 16 * 16;
+}
+
+static void *alloc(Arena *a, size_t size) {
+    size_t need = block_size(size);
+    Header *hdr;
+    if (need > MAX_SMALL_BLOCK) {
+        hdr = (Header *)new_chunk(a, need);
+    } else {
+        if (a->end - a->cur < need) {
+            a->cur = new_chunk(a, CHUNK_SIZE);
+            a->end = a->cur + CHUNK_SIZE;
+        }
+        hdr = (Header *)a->cur;
+        a->cur += need;
+    }
+    hdr->size = size;
+    return hdr + 1;
+}
+
+void *arena_calloc(size_t n, size_t size) {
+    return alloc(in_scratch ? &scratch : &unit, n * size);
+}
+
+void *arena_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return alloc(&unit, size);
+    }
+    Header *hdr = (Header *)ptr - 1;
+    size_t old = hdr->size;
+    if (size <= old) {
+        return ptr;
+    }
+
+    // A large block is resized with its chunk, so that growing arrays
+    // do not leave copies of themselves behind
+    if (block_size(old) > MAX_SMALL_BLOCK) {
+        Chunk **link = &unit.chunks;
+        while (*link && *link != (Chunk *)hdr - 1) {
+            link = &(*link)->next;
+        }
+        if (!*link) {
+            link = &scratch.chunks;
+            while (*link != (Chunk *)hdr - 1) {
+                link = &(*link)->next;
+            }
+        }
+        Chunk *chunk = realloc(*link, sizeof(Chunk) + block_size(size));
+        if (!chunk) {
+            error("out of memory");
+        }
+        *link = chunk;
+        hdr = (Header *)(chunk + 1);
+        hdr->size = size;
+        memset((char *)(hdr + 1) + old, 0, size - old);
+        return hdr + 1;
+    }
+
+    void *ptr2 = alloc(&unit, size);
+    memcpy(ptr2, ptr, old);
+    return ptr2;
+}
+
+char *arena_strndup(char *s, size_t n) {
+    size_t len = strnlen(s, n);
+    char *s2 = arena_calloc(1, len + 1);
+    memcpy(s2, s, len);
+    return s2;
+}
+
+static void free_arena(Arena *a) {
+    while (a->chunks) {
+        Chunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    a->cur = a->end = NULL;
+}
+
+// Makes arena_calloc allocate from the scratch arena or from the arena
+// of the compilation, and returns which it allocated from before
+bool arena_use_scratch(bool on) {
+    bool was = in_scratch;
+    in_scratch = on;
+    return was;
+}
+
+// Frees everything allocated from the scratch arena
+void arena_free_scratch(void) {
+    free_arena(&scratch);
+}
+
+// Frees everything allocated by the current thread
+void arena_release(void) {
+    free_arena(&unit);
+    free_arena(&scratch);
+    in_scratch = false;
+}
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Measures how fast ncc compiles the synthetic programs made by bench/gen.
+#
+# Each workload is compiled RUNS times, and the fastest run counts. The
+# results go to bench/results.csv. If bench/baseline.csv exists, the
+# throughput of each workload is compared with it; `make bench-baseline`
+# saves the current results as the baseline.
+#
+# Environment:
+#   RUNS   number of compilations per workload (default 5)
+#   SCALE  multiplier for the size of every workload (default 1)
+
+cd "$(dirname "$0")/.."
+
+RUNS=${RUNS:-5}
+SCALE=${SCALE:-1}
+OUT=bench/out
+RESULTS=bench/results.csv
+BASELINE=bench/baseline.csv
+
+workloads="functions:400 globals:2000 exprs:50 strings:1000 loops:300"
+
+mkdir -p $OUT
+echo "workload,scale,bytes,lines,tokens,seconds,lines_per_sec,tokens_per_sec,peak_rss_kb" > $RESULTS
+
+# Prints the value of a counter in the JSON statistics of ncc
+counter() {
+  grep -o "\"$1\": [0-9]*" "$2" | cut -d' ' -f2
+}
+
+printf "%-10s %8s %8s %10s %12s %12s %9s %8s\n" \
+  workload lines tokens seconds lines/s tokens/s "rss (kB)" "vs base"
+
+for w in $workloads; do
+  name=${w%%:*}
+  scale=$((${w##*:} * SCALE))
+  src=$OUT/$name.c
+  bench/gen $name $scale > $src || exit 1
+
+  best=
+  for i in $(seq $RUNS); do
+    start=$(date +%s%N)
+    ./ncc -fstats=json $src > $OUT/$name.s 2> $OUT/$name.json || exit 1
+    end=$(date +%s%N)
+    ns=$((end - start))
+    if [ -z "$best" ] || [ $ns -lt $best ]; then
+      best=$ns
+    fi
+  done
+
+  bytes=$(counter bytes $OUT/$name.json)
+  lines=$(counter lines $OUT/$name.json)
+  tokens=$(counter tokens $OUT/$name.json)
+  rss=$(counter peak_rss_kb $OUT/$name.json)
+  seconds=$(awk "BEGIN { printf \"%.6f\", $best / 1e9 }")
+  lps=$(awk "BEGIN { printf \"%.0f\", $lines / $seconds }")
+  tps=$(awk "BEGIN { printf \"%.0f\", $tokens / $seconds }")
+  echo "$name,$scale,$bytes,$lines,$tokens,$seconds,$lps,$tps,$rss" >> $RESULTS
+
+  delta=-
+  if [ -f $BASELINE ]; then
+    base=$(awk -F, -v w=$name -v s=$scale '$1 == w && $2 == s { print $7 }' $BASELINE)
+    if [ -n "$base" ]; then
+      delta=$(awk "BEGIN { printf \"%+.1f%%\", ($lps / $base - 1) * 100 }")
+    fi
+  fi
+
+  printf "%-10s %8d %8d %10s %12d %12d %9d %8s\n" \
+    $name $lines $tokens $seconds $lps $tps $rss "$delta"
+done
+
+echo "results written to $RESULTS"
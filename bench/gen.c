@@ -0,0 +1,172 @@
+// Generator of synthetic programs for compile-throughput benchmarks.
+//
+//   gen <workload> <scale>
+//
+// writes a program in the subset of C that ncc accepts to stdout. The
+// size of the program grows linearly with the scale. Programs are
+// deterministic, so the same workload and scale always give the same
+// source.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long seed = 1;
+
+static int rnd(int n) {
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (seed >> 33) % n;
+}
+
+// Many small functions, each calling the previous one
+static void gen_functions(int n) {
+    for (int i = 0; i < n; i++) {
+        printf("int f%d(int a, int b) {\n", i);
+        printf("  int x;\n");
+        printf("  x = a * %d + b;\n", i % 7 + 1);
+        printf("  if (x > %d) {\n", i);
+        printf("    x = x - b;\n");
+        printf("  }\n");
+        if (i > 0) {
+            printf("  return x + f%d(b, a);\n", i - 1);
+        } else {
+            printf("  return x;\n");
+        }
+        printf("}\n");
+    }
+    printf("int main() {\n  return f%d(1, 2);\n}\n", n - 1);
+}
+
+// Many global variables of every type, and functions that use them
+static void gen_globals(int n) {
+    for (int i = 0; i < n; i++) {
+        printf("int g%d;\n", i);
+        printf("char c%d[%d];\n", i, i % 32 + 1);
+        printf("int *p%d;\n", i);
+    }
+    for (int i = 0; i < n; i += 64) {
+        printf("int use%d() {\n", i);
+        for (int j = i; j < i + 64 && j < n; j++) {
+            printf("  p%d = &g%d;\n", j, j);
+            printf("  c%d[0] = %d;\n", j, j % 100);
+            printf("  g%d = *p%d + c%d[0];\n", j, j, j);
+        }
+        printf("  return g%d;\n}\n", i);
+    }
+    printf("int main() {\n  return use0();\n}\n");
+}
+
+static void gen_expr(int depth) {
+    static char *vars[] = {"a", "b", "c", "d"};
+    static char *ops[] = {"+", "-", "*", "+", "-", "==", "<", "!="};
+
+    if (depth == 0 || rnd(4) == 0) {
+        if (rnd(2)) {
+            printf("%s", vars[rnd(4)]);
+        } else {
+            printf("%d", rnd(1000));
+        }
+        return;
+    }
+    printf("(");
+    gen_expr(depth - 1);
+    printf(" %s ", ops[rnd(8)]);
+    gen_expr(depth - 1);
+    printf(")");
+}
+
+// Functions made of deeply nested expressions
+static void gen_exprs(int n) {
+    for (int i = 0; i < n; i++) {
+        printf("int e%d(int a, int b, int c, int d) {\n", i);
+        printf("  int x;\n");
+        for (int j = 0; j < 4; j++) {
+            printf("  x = ");
+            gen_expr(10);
+            printf(";\n");
+            printf("  a = b + x;\n");
+        }
+        printf("  return x;\n}\n");
+    }
+    printf("int main() {\n  return e0(1, 2, 3, 4);\n}\n");
+}
+
+// Functions returning characters of long string literals
+static void gen_strings(int n) {
+    for (int i = 0; i < n; i++) {
+        printf("int s%d() {\n", i);
+        printf("  char *s;\n");
+        printf("  s = \"");
+        for (int j = 0; j < 400; j++) {
+            int c = rnd(64);
+            if (c == 0) {
+                printf("\\n");
+            } else if (c == 1) {
+                printf("\\t");
+            } else if (c == 2) {
+                printf("\\\"");
+            } else {
+                putchar('a' + c % 26);
+            }
+        }
+        printf("\";\n");
+        printf("  return s[%d];\n}\n", i % 400);
+    }
+    printf("int main() {\n  return s0();\n}\n");
+}
+
+// Functions with nests of for loops over arrays
+static void gen_loops(int n) {
+    for (int i = 0; i < n; i++) {
+        int depth = i % 6 + 1;
+        printf("int l%d(int n) {\n", i);
+        printf("  int a[64];\n");
+        printf("  int s;\n");
+        for (int d = 0; d < depth; d++) {
+            printf("  int i%d;\n", d);
+        }
+        printf("  s = 0;\n");
+        for (int d = 0; d < depth; d++) {
+            printf("%*sfor (i%d = 0; i%d < n; i%d = i%d + 1) {\n", 2 + d * 2, "",
+                   d, d, d, d);
+        }
+        printf("%*sa[i0] = a[i%d] + i%d * %d;\n", 2 + depth * 2, "", depth - 1,
+               depth - 1, i % 9 + 1);
+        printf("%*ss = s + a[i0];\n", 2 + depth * 2, "");
+        for (int d = depth - 1; d >= 0; d--) {
+            printf("%*s}\n", 2 + d * 2, "");
+        }
+        printf("  return s;\n}\n");
+    }
+    printf("int main() {\n  return l0(8);\n}\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s functions|globals|exprs|strings|loops <scale>\n",
+                argv[0]);
+        return 1;
+    }
+
+    char *kind = argv[1];
+    int n = atoi(argv[2]);
+    if (n <= 0) {
+        fprintf(stderr, "%s: scale must be positive\n", argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(kind, "functions")) {
+        gen_functions(n);
+    } else if (!strcmp(kind, "globals")) {
+        gen_globals(n);
+    } else if (!strcmp(kind, "exprs")) {
+        gen_exprs(n);
+    } else if (!strcmp(kind, "strings")) {
+        gen_strings(n);
+    } else if (!strcmp(kind, "loops")) {
+        gen_loops(n);
+    } else {
+        fprintf(stderr, "%s: unknown workload: %s\n", argv[0], kind);
+        return 1;
+    }
+    return 0;
+}
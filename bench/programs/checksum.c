@@ -0,0 +1,47 @@
+char data[65536];
+
+int adler32(char *buf, int len) {
+    int a;
+    int b;
+    int i;
+    a = 1;
+    b = 0;
+    for (i = 0; i < len; i = i + 1) {
+        a = a + buf[i] + 128;
+        a = a - a / 65521 * 65521;
+        b = b + a;
+        b = b - b / 65521 * 65521;
+    }
+    return b * 65536 + a;
+}
+
+int fletcher(char *buf, int len) {
+    int s1;
+    int s2;
+    int i;
+    s1 = 0;
+    s2 = 0;
+    for (i = 0; i < len; i = i + 1) {
+        s1 = s1 + buf[i];
+        s2 = s2 + s1;
+    }
+    return s1 + s2;
+}
+
+int main() {
+    int i;
+    int x;
+    int r;
+    int total;
+    x = 12345;
+    for (i = 0; i < 65536; i = i + 1) {
+        x = x * 1103515245 + 12345;
+        x = x - x / 2147483648 * 2147483648;
+        data[i] = x / 65536;
+    }
+    total = 0;
+    for (r = 0; r < 100; r = r + 1) {
+        total = total + adler32(data, 65536) + fletcher(data, 65536);
+    }
+    return total - total / 256 * 256;
+}
@@ -0,0 +1,38 @@
+int a[40000];
+int b[40000];
+int c[40000];
+
+int matmul(int n) {
+    int i;
+    int j;
+    int k;
+    int s;
+    for (i = 0; i < n; i = i + 1) {
+        for (j = 0; j < n; j = j + 1) {
+            s = 0;
+            for (k = 0; k < n; k = k + 1) {
+                s = s + a[i * n + k] * b[k * n + j];
+            }
+            c[i * n + j] = s;
+        }
+    }
+    return c[n * n - 1];
+}
+
+int main() {
+    int n;
+    int i;
+    int r;
+    int total;
+    n = 200;
+    for (i = 0; i < n * n; i = i + 1) {
+        a[i] = i - i / 7 * 7;
+        b[i] = i - i / 5 * 5;
+    }
+    total = 0;
+    for (r = 0; r < 5; r = r + 1) {
+        total = total + matmul(n);
+        a[r] = a[r] + 1;
+    }
+    return total - total / 256 * 256;
+}
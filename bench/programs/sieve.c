@@ -0,0 +1,30 @@
+char flags[1000001];
+
+int sieve(int n) {
+    int i;
+    int j;
+    int count;
+    for (i = 2; i <= n; i = i + 1) {
+        flags[i] = 1;
+    }
+    count = 0;
+    for (i = 2; i <= n; i = i + 1) {
+        if (flags[i]) {
+            count = count + 1;
+            for (j = i + i; j <= n; j = j + i) {
+                flags[j] = 0;
+            }
+        }
+    }
+    return count;
+}
+
+int main() {
+    int r;
+    int total;
+    total = 0;
+    for (r = 0; r < 20; r = r + 1) {
+        total = total + sieve(1000000);
+    }
+    return total - total / 256 * 256;
+}
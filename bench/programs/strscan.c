@@ -0,0 +1,54 @@
+int count_char(char *s, int c) {
+    int n;
+    char *p;
+    n = 0;
+    for (p = s; *p; p = p + 1) {
+        if (*p == c) {
+            n = n + 1;
+        }
+    }
+    return n;
+}
+
+int find(char *s, char *word) {
+    int n;
+    char *p;
+    char *q;
+    char *r;
+    int match;
+    n = 0;
+    for (p = s; *p; p = p + 1) {
+        match = 1;
+        r = p;
+        for (q = word; *q; q = q + 1) {
+            if (*r != *q) {
+                match = 0;
+            }
+            if (*r == 0) {
+                match = 0;
+                q = q - 1;
+            }
+            r = r + (*r != 0);
+            if (match == 0) {
+                for (; *q; q = q + 1) {
+                }
+                q = q - 1;
+            }
+        }
+        n = n + match;
+    }
+    return n;
+}
+
+int main() {
+    char *text;
+    int r;
+    int total;
+    text = "the quick brown fox jumps over the lazy dog while the other fox sleeps under the tree and the dog barks at the fox that jumps over the fence into the garden where the cat watches the birds sing in the morning sun and the wind blows through the leaves of the old oak tree";
+    total = 0;
+    for (r = 0; r < 20000; r = r + 1) {
+        total = total + count_char(text, 101) + count_char(text, 111);
+        total = total + find(text, "the") + find(text, "fox");
+    }
+    return total - total / 256 * 256;
+}
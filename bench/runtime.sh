@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# Measures how fast the code that ncc generates runs, compared with gcc.
+#
+# Every program in bench/programs is built with each configuration below
+# and run REPS times; the fastest run counts. The programs are written in
+# the subset of C that ncc accepts. Since int is 8 bytes in ncc, gcc
+# compiles them with int replaced by long so that both compute the same
+# result, which is checked through the exit status. Instruction counts
+# come from `perf stat` when it is installed. The results go to
+# bench/runtime.csv.
+#
+# Environment:
+#   REPS     number of runs per binary (default 5)
+#   CONFIGS  configurations to build (default: all of the ones below)
+
+cd "$(dirname "$0")/.."
+
+REPS=${REPS:-5}
+CONFIGS=${CONFIGS:-"ncc ncc-O0 gcc-O0 gcc-O1 gcc-O2"}
+OUT=bench/out/runtime
+RESULTS=bench/runtime.csv
+
+mkdir -p $OUT
+echo "program,config,seconds,instructions,text_bytes,status" > $RESULTS
+
+# Builds a program with a configuration
+build() {
+  local src=$1 config=$2 bin=$3
+  case $config in
+    ncc) ./ncc $src > $bin.s && gcc -o $bin $bin.s ;;
+    ncc-*) ./ncc -${config#ncc-} $src > $bin.s && gcc -o $bin $bin.s ;;
+    gcc-*)
+      sed 's/\bint\b/long/g' $src > $bin.c &&
+        gcc -w -${config#gcc-} -o $bin $bin.c ;;
+    *) echo "unknown configuration: $config" >&2; return 1 ;;
+  esac
+}
+
+# Prints the number of instructions a binary executes, or - without perf
+instructions() {
+  if ! command -v perf > /dev/null; then
+    echo -
+    return
+  fi
+  perf stat -x, -e instructions:u -o $OUT/perf.txt $1 > /dev/null 2>&1
+  awk -F, '/instructions/ { print $1 }' $OUT/perf.txt
+}
+
+printf "%-10s %-8s %10s %14s %8s %7s %9s\n" \
+  program config seconds instructions text status "vs ncc"
+
+for src in bench/programs/*.c; do
+  name=$(basename $src .c)
+  expected=
+  ncc_best=
+
+  for config in $CONFIGS; do
+    bin=$OUT/$name.$config
+    build $src $config $bin 2> $OUT/$name.$config.log || {
+      echo "$name: build failed with $config" >&2
+      cat $OUT/$name.$config.log >&2
+      exit 1
+    }
+
+    best=
+    for i in $(seq $REPS); do
+      start=$(date +%s%N)
+      $bin
+      status=$?
+      end=$(date +%s%N)
+      ns=$((end - start))
+      if [ -z "$best" ] || [ $ns -lt $best ]; then
+        best=$ns
+      fi
+    done
+
+    # Every configuration must compute the same result
+    if [ -z "$expected" ]; then
+      expected=$status
+    elif [ $status != $expected ]; then
+      echo "$name: $config exited with $status, expected $expected" >&2
+      exit 1
+    fi
+
+    if [ $config = ncc ]; then
+      ncc_best=$best
+    fi
+    ratio=-
+    if [ -n "$ncc_best" ]; then
+      ratio=$(awk "BEGIN { printf \"%.2fx\", $best / $ncc_best }")
+    fi
+
+    seconds=$(awk "BEGIN { printf \"%.6f\", $best / 1e9 }")
+    insts=$(instructions $bin)
+    text=$(size $bin | awk 'NR == 2 { print $1 }')
+    echo "$name,$config,$seconds,$insts,$text,$status" >> $RESULTS
+    printf "%-10s %-8s %10s %14s %8d %7d %9s\n" \
+      $name $config $seconds $insts $text $status $ratio
+  done
+done
+
+echo "results written to $RESULTS"
@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Compares compiling many small files with a new ncc process each time
+# against leaving the compilations to a compile server.
+#
+# Each mode compiles the same FILES programs made by bench/gen:
+#
+#   cold         one ncc process per file
+#   client       one ncc --client process per file
+#   cold-batch   one ncc -j JOBS process for all files
+#   client-batch one ncc --client -j JOBS process for all files
+#
+# The fastest of RUNS runs counts. The total time, the time per file and
+# the throughput go to bench/server.csv.
+#
+# Environment:
+#   FILES  number of files (default 200)
+#   SIZE   size of each file, as a scale of the functions workload (default 10)
+#   JOBS   concurrent compilations in the batch modes (default 4)
+#   RUNS   number of runs per mode (default 3)
+
+cd "$(dirname "$0")/.."
+
+FILES=${FILES:-200}
+SIZE=${SIZE:-10}
+JOBS=${JOBS:-4}
+RUNS=${RUNS:-3}
+OUT=bench/out/server
+RESULTS=bench/server.csv
+SOCKET=$OUT/ncc.sock
+
+rm -rf $OUT
+mkdir -p $OUT
+for i in $(seq $FILES); do
+  bench/gen functions $SIZE > $OUT/f$i.c || exit 1
+done
+
+./ncc --server $SOCKET &
+server=$!
+trap "kill $server 2> /dev/null" EXIT
+for i in $(seq 50); do
+  [ -S $SOCKET ] && break
+  sleep 0.1
+done
+
+cold() {
+  for f in $OUT/*.c; do
+    ./ncc $f > ${f%.c}.s || exit 1
+  done
+}
+
+client() {
+  for f in $OUT/*.c; do
+    ./ncc --client $SOCKET $f > ${f%.c}.s || exit 1
+  done
+}
+
+cold_batch() {
+  ./ncc -j $JOBS $OUT/*.c || exit 1
+}
+
+client_batch() {
+  ./ncc --client $SOCKET -j $JOBS $OUT/*.c || exit 1
+}
+
+echo "mode,files,seconds,ms_per_file,files_per_sec" > $RESULTS
+printf "%-14s %6s %10s %12s %10s\n" mode files seconds "ms/file" files/s
+
+for mode in cold client cold-batch client-batch; do
+  best=
+  for i in $(seq $RUNS); do
+    start=$(date +%s%N)
+    ${mode/-/_}
+    end=$(date +%s%N)
+    ns=$((end - start))
+    if [ -z "$best" ] || [ $ns -lt $best ]; then
+      best=$ns
+    fi
+  done
+
+  seconds=$(awk "BEGIN { printf \"%.6f\", $best / 1e9 }")
+  ms=$(awk "BEGIN { printf \"%.3f\", $best / 1e6 / $FILES }")
+  fps=$(awk "BEGIN { printf \"%.0f\", $FILES / ($best / 1e9) }")
+  echo "$mode,$FILES,$seconds,$ms,$fps" >> $RESULTS
+  printf "%-14s %6d %10s %12s %10d\n" $mode $FILES $seconds $ms $fps
+done
+
+echo "results written to $RESULTS"
@@ -0,0 +1,296 @@
+// Content-addressed cache of compilation results.
+//
+// With -fcache-dir=DIR, or NCC_CACHE_DIR in the environment, the
+// assembly of every successful compilation is stored in DIR under a hash
+// of everything it depends on: the source, the options, the compiler
+// itself and, with -fprofile-use, the profile. A compilation whose hash
+// is found skips all the passes and returns the stored assembly. Reports
+// such as -fopt-report come only from compilations that actually run.
+//
+// Entries are spread over 256 subdirectories by the first byte of their
+// hash. An entry is written to a temporary file and renamed into place,
+// so that concurrent compilers never see a partial one. The modification
+// time of an entry records its last use: a hit touches it, and after a
+// store, the least recently used entries are removed until the cache
+// fits in -fcache-max-size. The entry just stored is never removed.
+//
+// DIR/stats counts the hits, misses and stores of all compilers that use
+// the directory. `ncc --cache-stats` prints them.
+#include "ncc.h"
+#include "source_id.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NUM_SUBDIRS 256
+
+typedef unsigned __int128 Hash;
+
+// FNV-1a with 128-bit state
+#define FNV_OFFSET (((Hash)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d)
+#define FNV_PRIME (((Hash)1 << 88) | 0x13b)
+
+// Identifies the compiler by a hash of its sources, so that builds of
+// the same sources share the entries of the cache
+static char *compiler_id = "ncc " NCC_SOURCE_ID;
+
+typedef enum {
+    CACHE_HITS,
+    CACHE_MISSES,
+    CACHE_STORES,
+    NUM_CACHE_STATS,
+} CacheStat;
+
+static char *stat_names[] = {
+    [CACHE_HITS] = "hits",
+    [CACHE_MISSES] = "misses",
+    [CACHE_STORES] = "stores",
+};
+
+// Serializes updates of the stats file by threads of this process.
+// Record locks only exclude other processes.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Hash hash_bytes(Hash h, char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static Hash hash_string(Hash h, char *s) {
+    // The terminator keeps adjacent strings apart
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
+// Hashes the contents of a file, or nothing if it cannot be read
+static Hash hash_file(Hash h, char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return h;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        h = hash_bytes(h, buf, n);
+    }
+    fclose(fp);
+    return h;
+}
+
+// Returns the key of the current compilation of `input`
+char *cache_key(char *input) {
+    Hash h = hash_string(FNV_OFFSET, compiler_id);
+    for (char **flag = ctx->flags; flag && *flag; flag++) {
+        if (strncmp(*flag, "-fcache", 7)) {
+            h = hash_string(h, *flag);
+        }
+    }
+
+    // Debug information names the source file
+    if (opt_debug_info) {
+        h = hash_string(h, ctx->filename);
+    }
+    if (opt_profile_use) {
+        h = hash_file(h, opt_profile_use);
+    }
+    h = hash_string(h, input);
+    return format("%016lx%016lx", (unsigned long)(h >> 64), (unsigned long)h);
+}
+
+static char *subdir_path(char *key) {
+    return format("%s/%.2s", opt_cache_dir, key);
+}
+
+static char *entry_path(char *key) {
+    return format("%s/%.2s/%s.s", opt_cache_dir, key, key + 2);
+}
+
+// Creates a directory and its missing parents
+static void make_dirs(char *path) {
+    char *p = arena_strndup(path, strlen(path));
+    for (char *q = p + 1; *q; q++) {
+        if (*q == '/') {
+            *q = '\0';
+            mkdir(p, 0777);
+            *q = '/';
+        }
+    }
+    mkdir(p, 0777);
+}
+
+// Adds one to a counter of the stats file
+static void count(CacheStat stat) {
+    make_dirs(opt_cache_dir);
+    pthread_mutex_lock(&stats_lock);
+    int fd = open(format("%s/stats", opt_cache_dir), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    fcntl(fd, F_SETLKW, &lock);
+
+    char buf[256] = {};
+    long counts[NUM_CACHE_STATS] = {};
+    if (pread(fd, buf, sizeof(buf) - 1, 0) > 0) {
+        sscanf(buf, "hits %ld\nmisses %ld\nstores %ld", &counts[CACHE_HITS],
+               &counts[CACHE_MISSES], &counts[CACHE_STORES]);
+    }
+    counts[stat]++;
+
+    int len = snprintf(buf, sizeof(buf), "hits %ld\nmisses %ld\nstores %ld\n",
+                       counts[CACHE_HITS], counts[CACHE_MISSES], counts[CACHE_STORES]);
+    if (pwrite(fd, buf, len, 0) == len) {
+        ftruncate(fd, len);
+    }
+    close(fd);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Writes the stored assembly for `key` to the output, and returns false
+// if there is none
+bool cache_lookup(char *key) {
+    char *path = entry_path(key);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        count(CACHE_MISSES);
+        return false;
+    }
+
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        fwrite(buf, 1, n, ctx->out);
+    }
+    fclose(fp);
+
+    // Mark the entry as recently used
+    utimensat(AT_FDCWD, path, NULL, 0);
+    count(CACHE_HITS);
+    return true;
+}
+
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+} Entry;
+
+typedef struct {
+    Entry *data;
+    int len;
+    int capacity;
+    off_t size; // Total size of the entries
+} EntryList;
+
+static int cmp_mtime(const void *a, const void *b) {
+    const Entry *x = a;
+    const Entry *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+// Adds the entries of a subdirectory to `list`
+static void list_entries(char *dir, EntryList *list) {
+    DIR *dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dp))) {
+        struct stat st;
+        char *path = format("%s/%s", dir, de->d_name);
+        if (de->d_name[0] == '.' || stat(path, &st) || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (list->len == list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 64;
+            list->data = arena_realloc(list->data, sizeof(Entry) * list->capacity);
+        }
+        list->data[list->len++] = (Entry){path, st.st_size, st.st_mtim};
+        list->size += st.st_size;
+    }
+    closedir(dp);
+}
+
+static EntryList list_all_entries(void) {
+    EntryList list = {};
+    for (int i = 0; i < NUM_SUBDIRS; i++) {
+        list_entries(format("%s/%02x", opt_cache_dir, i), &list);
+    }
+    return list;
+}
+
+// Removes the least recently used entries other than `keep` until the
+// cache fits in its maximum size
+static void trim(char *keep) {
+    EntryList list = list_all_entries();
+    if (list.size <= opt_cache_max_size) {
+        return;
+    }
+
+    qsort(list.data, list.len, sizeof(Entry), cmp_mtime);
+    for (int i = 0; i < list.len && list.size > opt_cache_max_size; i++) {
+        Entry *e = &list.data[i];
+        if (strcmp(e->path, keep) && !unlink(e->path)) {
+            list.size -= e->size;
+        }
+    }
+}
+
+// Stores the assembly for `key`. Failures only cost the cache entry.
+void cache_store(char *key, char *data, size_t len) {
+    char *dir = subdir_path(key);
+    make_dirs(dir);
+
+    char *tmp = format("%s/.tmp.%d.%lx", dir, (int)getpid(), (unsigned long)pthread_self());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        return;
+    }
+    bool ok = fwrite(data, 1, len, fp) == len;
+    ok = !fclose(fp) && ok;
+    char *path = entry_path(key);
+    if (!ok || rename(tmp, path)) {
+        unlink(tmp);
+        return;
+    }
+
+    trim(path);
+    count(CACHE_STORES);
+}
+
+void print_cache_stats(FILE *out) {
+    if (!opt_cache_dir) {
+        error("no cache directory; use -fcache-dir=DIR or set NCC_CACHE_DIR");
+    }
+
+    long counts[NUM_CACHE_STATS] = {};
+    FILE *fp = fopen(format("%s/stats", opt_cache_dir), "r");
+    if (fp) {
+        fscanf(fp, "hits %ld\nmisses %ld\nstores %ld", &counts[CACHE_HITS],
+               &counts[CACHE_MISSES], &counts[CACHE_STORES]);
+        fclose(fp);
+    }
+
+    EntryList list = list_all_entries();
+
+    long lookups = counts[CACHE_HITS] + counts[CACHE_MISSES];
+    fprintf(out, "%-16s %s\n", "directory", opt_cache_dir);
+    for (int i = 0; i < NUM_CACHE_STATS; i++) {
+        fprintf(out, "%-16s %10ld\n", stat_names[i], counts[i]);
+    }
+    fprintf(out, "%-16s %9.1f%%\n", "hit rate",
+            lookups ? counts[CACHE_HITS] * 100.0 / lookups : 0);
+    fprintf(out, "%-16s %10ld\n", "entries", (long)list.len);
+    fprintf(out, "%-16s %10ld\n", "size (kB)", (long)(list.size / 1024));
+    fprintf(out, "%-16s %10ld\n", "max size (kB)", opt_cache_max_size / 1024);
+}
@@ -1,20 +1,28 @@
 #include "ncc.h"
 
-static int depth;
 static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
 static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static Obj *current_fn;
 
 static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+
+// Formats a line of assembly and appends it to the instruction buffer
+static void println(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *buf = vformat(fmt, ap);
+    va_end(ap);
+    emit_line(buf);
+}
 
 static void push(void) {
-    printf("  push %%rax\n");
-    depth++;
+    println("  push %%rax");
+    ctx->depth++;
 }
 
 static void pop(char *arg) {
-    printf("  pop  %s\n", arg);
-    depth--;
+    println("  pop  %s", arg);
+    ctx->depth--;
 }
 
 // Round up `n` to the nearest multiple of `align`.
@@ -22,16 +30,34 @@ static int align_to(int n, int align) {
     return (n + align - 1) / align * align;
 }
 
+static int count_args(Node *node) {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+        nargs++;
+    }
+    return nargs;
+}
+
+// Returns the memory operand of a variable
+static char *var_operand(Obj *var) {
+    if (!var->is_local) {
+        return format("%s(%%rip)", var->name);
+    }
+    if (ctx->current_fn->omit_frame) {
+        // %rsp moves as temporaries are pushed, so offsets from it
+        // depend on the current push depth.
+        return format("%d(%%rsp)",
+                      ctx->current_fn->stack_size + var->offset + ctx->depth * 8);
+    }
+    return format("%d(%%rbp)", var->offset);
+}
+
 // Compute the absolute address of a given node
 // It's an error if a given node dees not reside in memory
 static void gen_addr(Node *node) {
     switch (node->kind) {
     case ND_VAR:
-        if (node->var->is_local) {
-            printf("  lea %d(%%rbp), %%rax\n", node->var->offset);
-        } else {
-            printf("  lea %s(%%rip), %%rax\n", node->var->name);
-        }
+        println("  lea %s, %%rax", var_operand(node->var));
         return;
     case ND_DEREF:
         gen_expr(node->lhs);
@@ -41,19 +67,150 @@ static void gen_addr(Node *node) {
     error_tok(node->tok, "not an lvalue");
 }
 
+// Returns true if a given node may create a pointer to a local variable
+static bool has_addr(Node *node) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == ND_ADDR) {
+        return true;
+    }
+    // Arrays decay to pointers
+    if (node->kind == ND_VAR && node->var->is_local &&
+        node->var->ty->kind == TY_ARRAY) {
+        return true;
+    }
+
+    if (has_addr(node->lhs) || has_addr(node->rhs) || has_addr(node->cond) ||
+        has_addr(node->then) || has_addr(node->els) || has_addr(node->init) ||
+        has_addr(node->update)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (has_addr(n)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (has_addr(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// `return f(...)` can reuse the caller's return address and jump to
+// the callee after tearing down the frame, as long as the arguments fit
+// in registers and the callee cannot see the frame we are discarding.
+// An instrumented function has to call the exit hook after the callee
+// returns.
+static bool is_sibling_call(Node *node) {
+    return opt_sibling_calls && !opt_instrument_functions &&
+           node->kind == ND_RET_STMT &&
+           node->lhs->kind == ND_FUNCALL &&
+           count_args(node->lhs) <= sizeof(argreg64) / sizeof(*argreg64) &&
+           !ctx->current_fn->addr_taken;
+}
+
+// Returns true if a given node contains a function call that is not a
+// sibling call
+static bool has_funcall(Node *node) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == ND_FUNCALL) {
+        return true;
+    }
+    if (is_sibling_call(node)) {
+        return has_funcall(node->lhs->args);
+    }
+
+    if (has_funcall(node->lhs) || has_funcall(node->rhs) ||
+        has_funcall(node->cond) || has_funcall(node->then) ||
+        has_funcall(node->els) || has_funcall(node->init) ||
+        has_funcall(node->update)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (has_funcall(n)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (has_funcall(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Larger alignment first, then larger size first, so that no padding is
+// needed between variables. Ties keep their original order, which is
+// stored in `offset` until the variable is placed.
+static int cmp_lvar(const void *a, const void *b) {
+    Obj *x = *(Obj **)a;
+    Obj *y = *(Obj **)b;
+    if (x->ty->align != y->ty->align) {
+        return y->ty->align - x->ty->align;
+    }
+    if (x->ty->size != y->ty->size) {
+        return y->ty->size - x->ty->size;
+    }
+    return x->offset - y->offset;
+}
+
+// Assign offsets to the variables of a given scope and its nested scopes,
+// starting below `offset`. Sibling scopes are never live at the same time,
+// so they share the same stack slots. Returns the lowest offset used.
+static int assign_scope_offsets(Scope *sc, int offset) {
+    int nvars = 0;
+    for (Obj *var = sc->vars; var; var = var->scope_next) {
+        nvars++;
+    }
+
+    Obj **vars = calloc(nvars, sizeof(Obj *));
+    int i = 0;
+    for (Obj *var = sc->vars; var; var = var->scope_next) {
+        var->offset = i;
+        vars[i++] = var;
+    }
+    qsort(vars, nvars, sizeof(Obj *), cmp_lvar);
+
+    for (i = 0; i < nvars; i++) {
+        offset += vars[i]->ty->size;
+        offset = align_to(offset, vars[i]->ty->align);
+        vars[i]->offset = -offset;
+    }
+    free(vars);
+
+    int max = offset;
+    for (Scope *child = sc->children; child; child = child->next) {
+        int end = assign_scope_offsets(child, offset);
+        if (max < end) {
+            max = end;
+        }
+    }
+    return max;
+}
+
 // Align offsets to local variables
 static void assign_lvar_offsets(Obj *prog) {
     for (Obj *fn = prog; fn; fn = fn->next) {
-        if (!fn->is_function) {
+        if (!fn->is_function || fn->cached_asm) {
             continue;
         }
 
-        int offset = 0;
-        for (Obj *var = fn->locals; var; var = var->next) {
-            offset += var->ty->size;
-            var->offset = -offset;
-        }
-        fn->stack_size = align_to(offset, 16);
+        int offset = assign_scope_offsets(fn->root_scope, 0);
+
+        ctx->current_fn = fn;
+        fn->addr_taken = has_addr(fn->body);
+
+        // A leaf function does not need %rbp nor a 16-byte aligned stack
+        // because it makes no calls. Instrumented functions call hooks,
+        // and mcount finds its caller through the frame pointer.
+        fn->omit_frame = opt_omit_frame_pointer && !has_funcall(fn->body) &&
+                         !opt_instrument_functions && !opt_pg;
+        fn->stack_size = align_to(offset, fn->omit_frame ? 8 : 16);
     }
 }
 
@@ -63,9 +220,9 @@ static void load(Type *ty) {
     }
     
     if (ty->size == 1) {
-        printf("  movsbq (%%rax), %%rax\n");
+        println("  movsbq (%%rax), %%rax");
     } else {
-        printf("  mov (%%rax), %%rax\n");
+        println("  mov (%%rax), %%rax");
     }
 }
 
@@ -73,21 +230,214 @@ static void store(Type *ty) {
     pop("%rdi");
 
     if (ty->size == 1) {
-        printf("  mov %%al, (%%rdi)\n");
+        println("  mov %%al, (%%rdi)");
     } else {
-        printf("  mov %%rax, (%%rdi)\n");
+        println("  mov %%rax, (%%rdi)");
     }
 }
 
+// Evaluate arguments of a function call and load them to registers
+static void gen_args(Node *node) {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+        gen_expr(arg);
+        push();
+        nargs++;
+    }
+
+    for (int i = nargs - 1; i >= 0; i--) {
+        pop(argreg64[i]);
+    }
+}
+
+// Returns true if a given node is an integer constant
+static bool is_const(Node *node, long *val) {
+    if (node->kind == ND_NUM) {
+        *val = node->val;
+        return true;
+    }
+    if (node->kind == ND_NEG && node->lhs->kind == ND_NUM) {
+        *val = -(long)node->lhs->val;
+        return true;
+    }
+    return false;
+}
+
+// Multiply %rax by a constant. Multipliers of the form 2^k * {1,3,5,9}
+// become `lea` and `shl`.
+static void gen_mul_const(long val) {
+    unsigned long abs = (val < 0) ? -(unsigned long)val : val;
+    if (abs == 0) {
+        println("  mov $0, %%rax");
+        return;
+    }
+
+    int shift = __builtin_ctzl(abs);
+    unsigned long odd = abs >> shift;
+    if (odd != 1 && odd != 3 && odd != 5 && odd != 9) {
+        println("  imul $%ld, %%rax", val);
+        return;
+    }
+
+    if (odd != 1) {
+        println("  lea (%%rax,%%rax,%lu), %%rax", odd - 1);
+    }
+    if (shift) {
+        println("  shl $%d, %%rax", shift);
+    }
+    if (val < 0) {
+        println("  neg %%rax");
+    }
+}
+
+// Computes the magic number `m` and the shift amount `s` such that
+// x / d == (mulhi(x, m) >> s) for signed 64-bit `x` after adding the
+// sign bit of the result (Hacker's Delight, 10-1). `d` is not 0, 1
+// or -1.
+static void signed_magic(long d, long *m, int *s) {
+    unsigned long two63 = 1UL << 63;
+    unsigned long ad = (d < 0) ? -(unsigned long)d : d;
+    unsigned long t = two63 + ((unsigned long)d >> 63);
+    unsigned long anc = t - 1 - t % ad;
+    unsigned long q1 = two63 / anc;
+    unsigned long r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad;
+    unsigned long r2 = two63 - q2 * ad;
+    unsigned long delta;
+    int p = 63;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *m = (d < 0) ? -(long)(q2 + 1) : (long)(q2 + 1);
+    *s = p - 64;
+}
+
+// Divide %rax by a constant, rounding toward zero like idiv.
+static void gen_div_const(long val) {
+    if (val == 1) {
+        return;
+    }
+    if (val == -1) {
+        println("  neg %%rax");
+        return;
+    }
+
+    unsigned long abs = (val < 0) ? -(unsigned long)val : val;
+    if ((abs & (abs - 1)) == 0) {
+        // Add 2^k-1 to a negative dividend so that the shift rounds
+        // toward zero.
+        int shift = __builtin_ctzl(abs);
+        println("  mov %%rax, %%rdi");
+        println("  sar $63, %%rdi");
+        println("  shr $%d, %%rdi", 64 - shift);
+        println("  add %%rdi, %%rax");
+        println("  sar $%d, %%rax", shift);
+        if (val < 0) {
+            println("  neg %%rax");
+        }
+        return;
+    }
+
+    long m;
+    int s;
+    signed_magic(val, &m, &s);
+    println("  mov %%rax, %%rdi");
+    println("  mov $%ld, %%rdx", m);
+    println("  imul %%rdx");
+    if (val > 0 && m < 0) {
+        println("  add %%rdi, %%rdx");
+    } else if (val < 0 && m > 0) {
+        println("  sub %%rdi, %%rdx");
+    }
+    if (s) {
+        println("  sar $%d, %%rdx", s);
+    }
+    println("  mov %%rdx, %%rax");
+    println("  shr $63, %%rax");
+    println("  add %%rdx, %%rax");
+}
+
+// The difference of two pointers is a multiple of the element size, so
+// dividing it by a power of two needs no rounding fix-up.
+static bool is_exact_shift(long val) {
+    return val > 0 && (val & (val - 1)) == 0;
+}
+
+// Returns true if a given node is `ptr - ptr`
+static bool is_ptr_diff(Node *node) {
+    return node->kind == ND_SUB && node->lhs->ty->base && node->rhs->ty->base;
+}
+
+// Instruction suffix for a vector with lanes of a given type
+static char *lane_suffix(Type *ty) {
+    return (ty->size == 1) ? "b" : "q";
+}
+
+// Compute a vector expression into %xmm<reg>. Subexpressions use the
+// registers above `reg`, and scalar operands go through %rax.
+static void gen_vec(Node *node, int reg) {
+    switch (node->kind) {
+    case ND_VLOAD:
+        gen_expr(node->lhs);
+        println("  movdqu (%%rax), %%xmm%d", reg);
+        return;
+    case ND_VSPLAT:
+        gen_expr(node->lhs);
+        if (node->ty->size == 1) {
+            println("  movd %%eax, %%xmm%d", reg);
+            println("  punpcklbw %%xmm%d, %%xmm%d", reg, reg);
+            println("  punpcklwd %%xmm%d, %%xmm%d", reg, reg);
+            println("  pshufd $0, %%xmm%d, %%xmm%d", reg, reg);
+        } else {
+            println("  movq %%rax, %%xmm%d", reg);
+            println("  punpcklqdq %%xmm%d, %%xmm%d", reg, reg);
+        }
+        return;
+    case ND_VADD:
+    case ND_VSUB:
+        gen_vec(node->lhs, reg);
+        gen_vec(node->rhs, reg + 1);
+        println("  p%s%s %%xmm%d, %%xmm%d", node->kind == ND_VADD ? "add" : "sub",
+                lane_suffix(node->ty), reg + 1, reg);
+        return;
+    case ND_VEQ:
+        // pcmpeqb sets equal lanes to -1, so negate them to get 1.
+        gen_vec(node->lhs, reg);
+        gen_vec(node->rhs, reg + 1);
+        println("  pcmpeqb %%xmm%d, %%xmm%d", reg + 1, reg);
+        println("  pxor %%xmm%d, %%xmm%d", reg + 1, reg + 1);
+        println("  psubb %%xmm%d, %%xmm%d", reg, reg + 1);
+        println("  movdqa %%xmm%d, %%xmm%d", reg + 1, reg);
+        return;
+    }
+
+    error_tok(node->tok, "not a vector expression");
+}
+
 static void gen_expr(Node *node) {
     // printf("kind: %d\n", node->kind);
     switch (node->kind) {
     case ND_NUM:
-        printf("  mov $%d, %%rax\n", node->val); 
+        println("  mov $%d, %%rax", node->val); 
         return;
     case ND_NEG:
         gen_expr(node->lhs);
-        printf("  neg %%rax\n");
+        println("  neg %%rax");
         return;
     case ND_ADDR:
         gen_addr(node->lhs);
@@ -101,27 +451,93 @@ static void gen_expr(Node *node) {
         load(node->ty);
         return;
     case ND_ASSIGN:
+        // A variable's address is known statically, so it need not be
+        // kept on the stack while the value is computed.
+        if (node->lhs->kind == ND_VAR) {
+            gen_expr(node->rhs);
+            if (node->ty->size == 1) {
+                println("  mov %%al, %s", var_operand(node->lhs->var));
+            } else {
+                println("  mov %%rax, %s", var_operand(node->lhs->var));
+            }
+            return;
+        }
         gen_addr(node->lhs);
         push();
         gen_expr(node->rhs);
         store(node->ty);
         return;
-    case ND_FUNCALL: {
-        int nargs = 0;
-        for (Node *arg = node->args; arg; arg = arg->next) {
-            gen_expr(arg);
-            push();
-            nargs++;
+    case ND_VSTORE:
+        gen_vec(node->rhs, 0);
+        gen_expr(node->lhs);
+        println("  movdqu %%xmm0, (%%rax)");
+        return;
+    case ND_VSUM:
+        gen_vec(node->lhs, 0);
+        if (node->lhs->ty->size == 1) {
+            // psadbw adds up unsigned bytes, so flip the sign bits to
+            // bias each lane by 128 and subtract the bias afterwards.
+            println("  mov $0x80808080, %%eax");
+            println("  movd %%eax, %%xmm1");
+            println("  pshufd $0, %%xmm1, %%xmm1");
+            println("  pxor %%xmm1, %%xmm0");
+            println("  pxor %%xmm1, %%xmm1");
+            println("  psadbw %%xmm1, %%xmm0");
         }
-
-        for (int i = nargs - 1; i >= 0; i--) {
-            pop(argreg64[i]);
+        println("  pshufd $0x4e, %%xmm0, %%xmm1");
+        println("  paddq %%xmm1, %%xmm0");
+        println("  movq %%xmm0, %%rax");
+        if (node->lhs->ty->size == 1) {
+            println("  sub $%d, %%rax", 128 * 16);
         }
+        return;
+    case ND_STMT_EXPR:
+        for (Node *n = node->body; n; n = n->next) {
+            gen_stmt(n);
+        }
+        return;
+    case ND_EXPECT:
+        gen_expr(node->lhs);
+        return;
+    case ND_FUNCALL:
+        gen_args(node);
+        println("  mov $0, %%rax");
+        println("  call %s", node->funcname);
+        return;
+    }
 
-        printf("  mov $0, %%rax\n");
-        printf("  call %s\n", node->funcname);
+    // Adding or subtracting a constant needs no second register.
+    if ((node->kind == ND_ADD || node->kind == ND_SUB) &&
+        node->rhs->kind == ND_NUM) {
+        gen_expr(node->lhs);
+        println("  %s $%d, %%rax", node->kind == ND_ADD ? "add" : "sub",
+                node->rhs->val);
+        return;
+    }
+
+    // Multiplication and division by constants are done with shifts and
+    // multiplications that are cheaper than imul and idiv.
+    long val;
+    if (node->kind == ND_MUL && is_const(node->rhs, &val)) {
+        gen_expr(node->lhs);
+        gen_mul_const(val);
         return;
     }
+    if (node->kind == ND_MUL && is_const(node->lhs, &val)) {
+        gen_expr(node->rhs);
+        gen_mul_const(val);
+        return;
+    }
+    if (node->kind == ND_DIV && is_const(node->rhs, &val) && val != 0) {
+        gen_expr(node->lhs);
+        if (is_ptr_diff(node->lhs) && is_exact_shift(val)) {
+            if (val > 1) {
+                println("  sar $%d, %%rax", __builtin_ctzl(val));
+            }
+        } else {
+            gen_div_const(val);
+        }
+        return;
     }
 
     gen_expr(node->rhs);
@@ -131,49 +547,155 @@ static void gen_expr(Node *node) {
 
     switch (node->kind) {
     case ND_ADD:
-        printf("  add %%rdi, %%rax\n");
+        println("  add %%rdi, %%rax");
         return;
     case ND_SUB:
-        printf("  sub %%rdi, %%rax\n");
+        println("  sub %%rdi, %%rax");
         return;
     case ND_MUL:
-        printf("  imul %%rdi, %%rax\n");
+        println("  imul %%rdi, %%rax");
         return;
     case ND_DIV:
-        printf("  cqo\n");
-        printf("  idiv %%rdi\n");
+        println("  cqo");
+        println("  idiv %%rdi");
         return;
     case ND_EQ:
-        printf("  cmp %%rdi, %%rax\n");
-        printf("  sete %%al\n");
-        printf("  movzb %%al, %%rax\n");
+        println("  cmp %%rdi, %%rax");
+        println("  sete %%al");
+        println("  movzb %%al, %%rax");
         return;
     case ND_NE:
-        printf("  cmp %%rdi, %%rax\n");
-        printf("  setne %%al\n");
-        printf("  movzb %%al, %%rax\n");
+        println("  cmp %%rdi, %%rax");
+        println("  setne %%al");
+        println("  movzb %%al, %%rax");
         return;
     case ND_LT:
-        printf("  cmp %%rdi, %%rax\n");
-        printf("  setl %%al\n");
-        printf("  movzb %%al, %%rax\n");
+        println("  cmp %%rdi, %%rax");
+        println("  setl %%al");
+        println("  movzb %%al, %%rax");
         return;
     case ND_LE:
-        printf("  cmp %%rdi, %%rax\n");
-        printf("  setle %%al\n");
-        printf("  movzb %%al, %%rax\n");
+        println("  cmp %%rdi, %%rax");
+        println("  setle %%al");
+        println("  movzb %%al, %%rax");
         return;
     }
 
     error_tok(node->tok, "invalid expression");
 }
 
-static int count(void) {
-    static int i = 1;
-    return i++;
+// Returns a new label suffix. Labels are numbered within their function,
+// so that the assembly of a function does not depend on the others.
+static char *count(void) {
+    return format("%s.%d", ctx->current_fn->name, ++ctx->label_id);
+}
+
+// Restore the caller's %rsp and %rbp
+static void gen_frame_teardown(void) {
+    if (ctx->current_fn->omit_frame) {
+        println("  add $%d, %%rsp", ctx->current_fn->stack_size);
+    } else {
+        println("  mov %%rbp, %%rsp");
+        println("  pop %%rbp");
+        if (opt_debug_info) {
+            println("  .cfi_def_cfa %%rsp, 8");
+        }
+    }
+}
+
+// Records the source line of a node for the debugger and profilers,
+// unless it is the line of the previous code in the same section.
+// Changes of %rsp are described when the code is printed.
+static void gen_loc(Node *node) {
+    if (opt_debug_info && node->tok->line_no != ctx->last_line) {
+        ctx->last_line = node->tok->line_no;
+        println("  .loc 1 %d", ctx->last_line);
+    }
+}
+
+// Returns true if a given statement ends with a call to a function
+// that never returns.
+static bool ends_in_noreturn(Node *node) {
+    while (node->kind == ND_BLOCK) {
+        node = node->body;
+        if (!node) {
+            return false;
+        }
+        while (node->next) {
+            node = node->next;
+        }
+    }
+    return node->kind == ND_EXPR_STMT && node->lhs->kind == ND_FUNCALL &&
+           (!strcmp(node->lhs->funcname, "exit") ||
+            !strcmp(node->lhs->funcname, "abort"));
+}
+
+// Counts the number of times the program gets here
+static void gen_count(int id) {
+    if (opt_profile_generate && id) {
+        println("  incq .L.prof.counts+%d(%%rip)", (id - 1) * 8);
+    }
+}
+
+// Returns the number of times the then (or else) branch of an if
+// statement ran in the profile, or -1 if it is not known.
+static long branch_count(Node *node, bool then) {
+    long total = profile_count(node->prof_id);
+    if (total < 0) {
+        return -1;
+    }
+    long taken = profile_count(node->prof_id + 1);
+    return then ? taken : total - taken;
+}
+
+// Returns true if the then (or else) branch of an if statement is
+// unlikely to run. The profile decides if there is one that covers the
+// statement. Otherwise the condition may say so with __builtin_expect,
+// or the branch may end the program. If both branches look cold,
+// neither is treated as such.
+static bool is_cold(Node *node, bool then) {
+    Node *branch = then ? node->then : node->els;
+    Node *other = then ? node->els : node->then;
+    if (!opt_partition || !branch || ctx->in_cold_section) {
+        return false;
+    }
+    if (profile_count(node->prof_id) > 0) {
+        return branch_count(node, then) == 0;
+    }
+    if (node->cond->kind == ND_EXPECT) {
+        return (node->cond->val == 0) == then;
+    }
+    return ends_in_noreturn(branch) && !(other && ends_in_noreturn(other));
+}
+
+static void gen_then(Node *node) {
+    gen_count(node->prof_id ? node->prof_id + 1 : 0);
+    gen_stmt(node->then);
+}
+
+// Emits a branch that is unlikely to run out of line, in a section of
+// its own, so that it does not take up space in the hot code.
+static void gen_cold(Node *node, bool then, char *c) {
+    println("  .pushsection .text.unlikely,\"ax\",@progbits");
+    println(".L.cold.%s:", c);
+    ctx->last_line = 0;
+    ctx->in_cold_section = true;
+    if (then) {
+        gen_then(node);
+    } else {
+        gen_stmt(node->els);
+    }
+    ctx->in_cold_section = false;
+    println("  jmp .L.end.%s", c);
+    println("  .popsection");
+    ctx->last_line = 0;
 }
 
 static void gen_stmt(Node *node) {
+    if (node->kind != ND_BLOCK) {
+        gen_loc(node);
+    }
+
     switch (node->kind) {
     case ND_BLOCK:
         for (Node *n = node->body; n; n = n->next) {
@@ -181,41 +703,108 @@ static void gen_stmt(Node *node) {
         }
         return;
     case ND_IF_STMT: {
-        int c = count();
+        char *c = count();
+        gen_count(node->prof_id);
         gen_expr(node->cond);
-        printf("  cmp $0, %%rax\n");
-        printf("  je .L.else.%d\n", c); // if cond == 0, jump to .L.else
-        gen_stmt(node->then);
-        printf("  jmp .L.end.%d\n", c); // jump to .L.end for not entering else block
-        printf(".L.else.%d:\n", c);
+        println("  cmp $0, %%rax");
+        if (is_cold(node, true)) {
+            println("  jne .L.cold.%s", c);
+            gen_cold(node, true, c);
+            if (node->els) {
+                gen_stmt(node->els);
+            }
+            println(".L.end.%s:", c);
+            return;
+        }
+        if (is_cold(node, false)) {
+            println("  je .L.cold.%s", c);
+            gen_then(node);
+            gen_cold(node, false, c);
+            println(".L.end.%s:", c);
+            return;
+        }
+        if (node->els && branch_count(node, false) > branch_count(node, true)) {
+            // The else branch runs more often, so it goes first.
+            println("  jne .L.then.%s", c);
+            gen_stmt(node->els);
+            println("  jmp .L.end.%s", c);
+            println(".L.then.%s:", c);
+            gen_then(node);
+            println(".L.end.%s:", c);
+            return;
+        }
+        println("  je .L.else.%s", c); // if cond == 0, jump to .L.else
+        gen_then(node);
+        println("  jmp .L.end.%s", c); // jump to .L.end for not entering else block
+        println(".L.else.%s:", c);
         if (node->els) {
             gen_stmt(node->els);
         }
-        printf(".L.end.%d:\n", c);
+        println(".L.end.%s:", c);
         return;
     }
     case ND_FOR_STMT: {
-        int c = count();
+        char *c = count();
         if (node->init) {
             gen_expr(node->init);
         }
-        printf(".L.loop.%d:\n", c);
+        gen_count(node->prof_id);
+        if (opt_reorder_blocks) {
+            // Test at the bottom so that an iteration takes one branch
+            if (node->cond) {
+                println("  jmp .L.cond.%s", c);
+            }
+            // Padding loops that never run only wastes space
+            if (profile_count(node->prof_id) != 0) {
+                println("  .p2align 4");
+            }
+            println(".L.loop.%s:", c);
+            gen_then(node);
+            if (node->update) {
+                gen_loc(node->update);
+                gen_expr(node->update);
+            }
+            if (node->cond) {
+                println(".L.cond.%s:", c);
+                gen_loc(node->cond);
+                gen_expr(node->cond);
+                println("  cmp $0, %%rax");
+                println("  jne .L.loop.%s", c);
+            } else {
+                println("  jmp .L.loop.%s", c);
+            }
+            return;
+        }
+        println(".L.loop.%s:", c);
         if (node->cond) {
             gen_expr(node->cond);
-            printf("  cmp $0, %%rax\n");
-            printf("  je .L.end.%d\n", c); // if cond == 0, jump to .L.end
+            println("  cmp $0, %%rax");
+            println("  je .L.end.%s", c); // if cond == 0, jump to .L.end
         }
-        gen_stmt(node->then);
+        gen_then(node);
         if (node->update) {
             gen_expr(node->update);
         }
-        printf("  jmp .L.loop.%d\n", c);
-        printf(".L.end.%d:\n", c);
+        println("  jmp .L.loop.%s", c);
+        println(".L.end.%s:", c);
         return;
     }
     case ND_RET_STMT:
+        if (is_sibling_call(node)) {
+            gen_args(node->lhs);
+            if (opt_debug_info) {
+                println("  .cfi_remember_state");
+            }
+            gen_frame_teardown();
+            println("  mov $0, %%rax");
+            println("  jmp %s", node->lhs->funcname);
+            if (opt_debug_info) {
+                println("  .cfi_restore_state");
+            }
+            return;
+        }
         gen_expr(node->lhs);
-        printf("  jmp .L.return.%s\n", current_fn->name);
+        println("  jmp .L.return.%s", ctx->current_fn->name);
         return;
     case ND_EXPR_STMT:
         gen_expr(node->lhs);
@@ -225,24 +814,181 @@ static void gen_stmt(Node *node) {
     error_tok(node->tok, "invalid statement");
 }
 
-static void emit_data(Obj *prog) {
-    for (Obj *var = prog; var; var = var->next) {
-        if (var->is_function) {
-            continue;
+// Returns `len` bytes as the operand of .ascii or .string
+static char *quote(char *p, int len) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    fputc('"', out);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = p[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (isprint(c)) {
+            fputc(c, out);
+        } else {
+            fprintf(out, "\\%03o", c);
         }
+    }
+    fputc('"', out);
+    fclose(out);
 
-        printf("  .data\n");
-        printf("  .global %s\n", var->name);
-        printf("%s:\n", var->name);
+    char *s = arena_strndup(buf, buflen);
+    free(buf);
+    return s;
+}
 
-        if (var->init_data) {
-            for (int i = 0; i < var->ty->size; i++) {
-                printf("  .byte %d\n", var->init_data[i]);
+// Emits bytes as .ascii lines, with runs of zeros as .zero
+static void emit_bytes(char *p, int len) {
+    int i = 0;
+    while (i < len) {
+        int zeros = 0;
+        while (i + zeros < len && p[i + zeros] == 0) {
+            zeros++;
+        }
+        if (zeros >= 8 || i + zeros == len) {
+            if (zeros) {
+                println("  .zero %d", zeros);
             }
+            i += zeros;
+            continue;
+        }
+
+        int n = 0;
+        while (i + n < len && n < 64) {
+            n++;
+        }
+        println("  .ascii %s", quote(p + i, n));
+        i += n;
+    }
+}
+
+// Writes out the assembly of a global. Memory from the scratch arena,
+// which holds the assembly with -fno-unit-at-a-time, goes with it.
+static void flush_global(void) {
+    flush_insts(ctx->out);
+    arena_free_scratch();
+}
+
+// Const globals are read-only, except that the dynamic linker has to
+// relocate the addresses they hold in a position-independent executable
+// before it protects them
+static char *data_section(Obj *var) {
+    if (var->is_const) {
+        return var->rel ? ".section .data.rel.ro" : ".section .rodata";
+    }
+    return var->init_data ? ".data" : ".bss";
+}
+
+static void emit_global(Obj *var) {
+    println("  %s", data_section(var));
+    if (!var->is_static) {
+        println("  .global %s", var->name);
+    }
+    println("  .balign %d", var->ty->align);
+    println("%s:", var->name);
+
+    if (!var->init_data) {
+        println("  .zero %d", var->ty->size);
+        flush_global();
+        return;
+    }
+
+    // The addresses the data holds are left to the linker
+    int pos = 0;
+    for (Relocation *rel = var->rel; rel; rel = rel->next) {
+        emit_bytes(var->init_data + pos, rel->offset - pos);
+        if (rel->addend) {
+            println("  .quad %s%+ld", rel->var->name, rel->addend);
         } else {
-            printf("  .zero %d\n", var->ty->size);
+            println("  .quad %s", rel->var->name);
+        }
+        pos = rel->offset + 8;
+    }
+    emit_bytes(var->init_data + pos, var->ty->size - pos);
+    flush_global();
+}
+
+// Compares the contents of string literals from their ends
+static int cmp_reversed(const void *a, const void *b) {
+    Obj *x = *(Obj **)a;
+    Obj *y = *(Obj **)b;
+    int i = x->ty->size - 1;
+    int j = y->ty->size - 1;
+    for (; i >= 0 && j >= 0; i--, j--) {
+        unsigned char c = x->init_data[i];
+        unsigned char d = y->init_data[j];
+        if (c != d) {
+            return c - d;
+        }
+    }
+    return (i >= 0) - (j >= 0);
+}
+
+// Emits string literals into a section of NUL-terminated strings, which
+// the linker deduplicates across files. A literal that ends another one
+// is not emitted but defined as a label into it. Literals with a NUL
+// inside are not strings to the linker, so they go to plain .rodata.
+static void emit_string_literals(Obj *prog) {
+    int n = 0;
+    for (Obj *var = prog; var; var = var->next) {
+        n += var->is_literal;
+    }
+    Obj **strs = malloc(sizeof(Obj *) * n);
+    n = 0;
+    for (Obj *var = prog; var; var = var->next) {
+        if (!var->is_literal) {
+            continue;
+        }
+        if (memchr(var->init_data, 0, var->ty->size - 1)) {
+            println("  .section .rodata");
+            println("%s:", var->name);
+            emit_bytes(var->init_data, var->ty->size);
+            flush_global();
+            continue;
+        }
+        strs[n++] = var;
+    }
+
+    // Sorted by their reversed contents, every literal that ends another
+    // one comes right before one it ends
+    qsort(strs, n, sizeof(Obj *), cmp_reversed);
+    println("  .section .rodata.str1.1,\"aMS\",@progbits,1");
+    flush_global();
+    for (int i = n - 1; i >= 0; i--) {
+        Obj *var = strs[i];
+        if (i < n - 1) {
+            Obj *host = strs[i + 1];
+            int off = host->ty->size - var->ty->size;
+            if (off >= 0 && !memcmp(host->init_data + off, var->init_data, var->ty->size)) {
+                // The host may itself be defined inside a longer literal
+                println("  .set %s, %s+%d", var->name, host->name, off);
+                flush_global();
+                continue;
+            }
         }
+        println("%s:", var->name);
+        println("  .string %s", quote(var->init_data, var->ty->size - 1));
+        flush_global();
     }
+    free(strs);
+}
+
+static void emit_data(Obj *prog) {
+    for (Obj *var = prog; var; var = var->next) {
+        if (!var->is_function && !var->is_literal) {
+            emit_global(var);
+        }
+    }
+    emit_string_literals(prog);
+}
+
+// Calls an instrumentation hook with the address of the current
+// function and its return address.
+static void gen_hook(char *hook) {
+    println("  lea %s(%%rip), %%rdi", ctx->current_fn->name);
+    println("  mov 8(%%rbp), %%rsi");
+    println("  call %s", hook);
 }
 
 static void emit_text(Obj *prog) {
@@ -250,41 +996,196 @@ static void emit_text(Obj *prog) {
         if (!fn->is_function) {
             continue;
         }
+        if (fn->cached_asm) {
+            reuse_function_asm(fn);
+            continue;
+        }
 
-        printf("  .global main\n");
-        printf("  .text\n");
-        printf("%s:\n", fn->name);
-        current_fn = fn;
+        if (!fn->is_static) {
+            println("  .global %s", fn->name);
+        }
+        println("  .text");
+        println("  .type %s, @function", fn->name);
+        println("%s:", fn->name);
+        ctx->current_fn = fn;
+        ctx->label_id = 0;
+        ctx->last_line = 0;
+        if (opt_debug_info) {
+            println("  .cfi_startproc");
+            gen_loc(fn->body);
+        }
 
         // Prologue
-        printf("  push %%rbp\n");
-        printf("  mov %%rsp, %%rbp\n");
-        printf("  sub $%d, %%rsp\n", fn->stack_size);
+        if (!fn->omit_frame) {
+            println("  push %%rbp");
+            if (opt_debug_info) {
+                println("  .cfi_offset %%rbp, -16");
+            }
+            println("  mov %%rsp, %%rbp");
+            if (opt_debug_info) {
+                println("  .cfi_def_cfa_register %%rbp");
+            }
+        }
+        if (opt_pg) {
+            // mcount preserves the argument registers
+            println("  call mcount");
+        }
+        println("  sub $%d, %%rsp", fn->stack_size);
 
         // Save passed-by-register arguments to the stack
         int i = 0;
         for (Obj *var = fn->params; var; var = var->next) {
-            if (var->ty->size == 1) {
-                printf("  mov %s, %d(%%rbp)\n", argreg8[i++], var->offset);
+            char *reg = (var->ty->size == 1) ? argreg8[i++] : argreg64[i++];
+            if (fn->omit_frame) {
+                println("  mov %s, %d(%%rsp)", reg, fn->stack_size + var->offset);
             } else {
-                printf("  mov %s, %d(%%rbp)\n", argreg64[i++], var->offset);
+                println("  mov %s, %d(%%rbp)", reg, var->offset);
             }
         }
 
+        gen_count(fn->prof_id);
+        if (opt_instrument_functions) {
+            gen_hook("__cyg_profile_func_enter");
+        }
+
         // Traverse the AST to emit assembly
         gen_stmt(fn->body);
-        assert(depth == 0);
+        assert(ctx->depth == 0);
 
         // Epilogue
-        printf(".L.return.%s:\n", fn->name);
-        printf("  mov %%rbp, %%rsp\n");
-        printf("  pop %%rbp\n");
-        printf("  ret\n");
+        println(".L.return.%s:", fn->name);
+        if (opt_instrument_functions) {
+            // Keep the return value and the stack aligned across the call
+            println("  push %%rax");
+            println("  push %%rax");
+            gen_hook("__cyg_profile_func_exit");
+            println("  pop %%rax");
+            println("  pop %%rax");
+        }
+        gen_frame_teardown();
+        println("  ret");
+        if (opt_debug_info) {
+            println("  .cfi_endproc");
+        }
+        println("  .size %s, .-%s", fn->name, fn->name);
+        if (ctx->fn_cache) {
+            save_function_asm(fn);
+        } else {
+            flush_insts(ctx->out);
+        }
     }
 }
 
-void codegen(Obj *prog) {
+// Emits the counters of an instrumented program and a destructor that
+// appends them to the profile when the program exits.
+static void emit_profile(void) {
+    println("  .data");
+    println("  .p2align 3");
+    println(".L.prof.counts:");
+    println("  .zero %d", nprof_counters * 8);
+
+    // The function name, checksum and index of each counter
+    println(".L.prof.sites:");
+    for (int i = 0; i < nprof_counters; i++) {
+        ProfileCounter *c = &prof_counters[i];
+        println("  .quad .L.prof.name.%d", i - c->index);
+        println("  .quad %u", c->checksum);
+        println("  .quad %d", c->index);
+    }
+    println(".L.prof.end:");
+    for (int i = 0; i < nprof_counters; i++) {
+        if (prof_counters[i].index == 0) {
+            println(".L.prof.name.%d:", i);
+            println("  .string \"%s\"", prof_counters[i].fn);
+        }
+    }
+    println(".L.prof.path:");
+    println("  .string \"%s\"", opt_profile_generate);
+    println(".L.prof.mode:");
+    println("  .string \"a\"");
+    println(".L.prof.format:");
+    println("  .string \"%%s %%lu %%ld %%ld\\n\"");
+
+    println("  .text");
+    println(".L.prof.dump:");
+    println("  push %%rbx");
+    println("  push %%r12");
+    println("  push %%r13");
+    println("  lea .L.prof.path(%%rip), %%rdi");
+    println("  lea .L.prof.mode(%%rip), %%rsi");
+    println("  call fopen");
+    println("  test %%rax, %%rax");
+    println("  je .L.prof.done");
+    println("  mov %%rax, %%rbx");
+    println("  lea .L.prof.sites(%%rip), %%r12");
+    println("  lea .L.prof.counts(%%rip), %%r13");
+    println(".L.prof.next:");
+    println("  mov %%rbx, %%rdi");
+    println("  lea .L.prof.format(%%rip), %%rsi");
+    println("  mov (%%r12), %%rdx");
+    println("  mov 8(%%r12), %%rcx");
+    println("  mov 16(%%r12), %%r8");
+    println("  mov (%%r13), %%r9");
+    println("  mov $0, %%rax");
+    println("  call fprintf");
+    println("  add $24, %%r12");
+    println("  add $8, %%r13");
+    println("  lea .L.prof.end(%%rip), %%rax");
+    println("  cmp %%rax, %%r12");
+    println("  jne .L.prof.next");
+    println("  mov %%rbx, %%rdi");
+    println("  call fclose");
+    println(".L.prof.done:");
+    println("  pop %%r13");
+    println("  pop %%r12");
+    println("  pop %%rbx");
+    println("  ret");
+
+    println("  .section .fini_array,\"aw\"");
+    println("  .p2align 3");
+    println("  .quad .L.prof.dump");
+    flush_insts(ctx->out);
+}
+
+void codegen_begin(char *filename) {
+    if (opt_debug_info) {
+        println("  .file 1 \"%s\"", strcmp(filename, "-") ? filename : "<stdin>");
+        flush_insts(ctx->out);
+    }
+}
+
+// Emits one function when compiling a function at a time
+void codegen_function(Obj *fn) {
+    phase_begin(PH_LAYOUT);
+    assign_lvar_offsets(fn);
+    phase_end();
+
+    phase_begin(PH_EMIT);
+    emit_text(fn);
+    phase_end();
+}
+
+// Emits the globals when compiling a function at a time, once all the
+// functions are. The assembly of each is freed as soon as it is written.
+void codegen_data(Obj *prog) {
+    phase_begin(PH_EMIT);
+    arena_use_scratch(true);
+    emit_data(prog);
+    arena_use_scratch(false);
+    phase_end();
+}
+
+void codegen(Obj *prog, char *filename) {
+    codegen_begin(filename);
+    phase_begin(PH_LAYOUT);
     assign_lvar_offsets(prog);
+    phase_end();
+
+    phase_begin(PH_EMIT);
     emit_data(prog);
     emit_text(prog);
+    if (opt_profile_generate && nprof_counters) {
+        emit_profile();
+    }
+    phase_end();
 }
@@ -0,0 +1,181 @@
+// Compilation of a translation unit.
+//
+// The state of a compilation lives in its Context and in thread-local
+// variables of the passes, and its options are thread-local too. Every
+// compilation runs on a thread of its own, which starts with fresh
+// thread-local state and applies the options of its Context, so
+// translation units can be compiled concurrently. An error unwinds to
+// the start of the thread and fails only the compilation it occurs in.
+#include "ncc.h"
+#include <pthread.h>
+
+_Thread_local Context *ctx;
+
+static Obj *optimize(Obj *prog) {
+    if (opt_inline_limit > 0) {
+        phase_begin(PH_INLINE);
+        inline_functions(prog);
+        phase_end();
+    }
+    if (opt_licm || opt_ivopts || opt_unroll_factor > 1 || opt_unroll_limit > 0 ||
+        opt_vectorize) {
+        phase_begin(PH_LOOPS);
+        optimize_loops(prog);
+        phase_end();
+    }
+    if (opt_cse) {
+        phase_begin(PH_CSE);
+        eliminate_common_subexprs(prog);
+        phase_end();
+    }
+    if (opt_whole_program) {
+        phase_begin(PH_WHOLE_PROGRAM);
+        prog = remove_unreachable(prog);
+        phase_end();
+    }
+    return prog;
+}
+
+static void compile_unit(char *input) {
+    Token *tok = tokenize_input(input);
+
+    phase_begin(PH_PARSE);
+    Obj *prog = parse(tok);
+    phase_end();
+
+    phase_begin(PH_PROFILE);
+    if (opt_profile_generate || opt_profile_use) {
+        assign_profile_counters(prog);
+    }
+    if (opt_profile_use) {
+        read_profile(opt_profile_use);
+    }
+    phase_end();
+
+    if (ctx->fn_cache && !opt_profile_generate && !opt_profile_use) {
+        reuse_functions(prog);
+    }
+
+    prog = optimize(prog);
+    codegen(prog, ctx->filename);
+    if (ctx->fn_cache) {
+        commit_functions();
+    }
+}
+
+// With -fno-unit-at-a-time, every function is parsed, optimized and
+// emitted before the next one is read, and its memory is freed then.
+// Only the globals stay until they are emitted at the end, so the memory
+// a compilation needs grows with its largest function rather than with
+// the whole file.
+static void compile_functions(char *input) {
+    codegen_begin(ctx->filename);
+    ctx->globals = NULL;
+    char *p = input;
+
+    for (;;) {
+        arena_use_scratch(true);
+        Token *tok = tokenize_next_decl(&p);
+        if (tok->kind == TK_EOF) {
+            break;
+        }
+
+        phase_begin(PH_PARSE);
+        Obj *fn = parse_toplevel(tok);
+        phase_end();
+
+        if (fn) {
+            codegen_function(optimize(fn));
+        }
+        arena_use_scratch(false);
+        arena_free_scratch();
+    }
+
+    arena_use_scratch(false);
+    arena_free_scratch();
+    codegen_data(ctx->globals);
+}
+
+static void run_passes(void) {
+    for (char **flag = ctx->flags; flag && *flag; flag++) {
+        if (!set_option(*flag)) {
+            error("unknown argument: %s", *flag);
+        }
+    }
+    finish_options();
+
+    char *input = read_input();
+    char *key = NULL;
+    FILE *out = ctx->out;
+    if (opt_cache_dir) {
+        key = cache_key(input);
+        if (cache_lookup(key)) {
+            print_stats(ctx->diag);
+            return;
+        }
+        // Capture the assembly to store it
+        ctx->cache_out = open_memstream(&ctx->cache_buf, &ctx->cache_len);
+        ctx->out = ctx->cache_out;
+    }
+
+    // Reusing functions needs the whole unit
+    if (opt_unit_at_a_time || ctx->fn_cache) {
+        compile_unit(input);
+    } else {
+        compile_functions(input);
+    }
+
+    if (key) {
+        fclose(ctx->cache_out);
+        ctx->cache_out = NULL;
+        ctx->out = out;
+        fwrite(ctx->cache_buf, 1, ctx->cache_len, out);
+        cache_store(key, ctx->cache_buf, ctx->cache_len);
+        free(ctx->cache_buf);
+        ctx->cache_buf = NULL;
+    }
+
+    if (opt_peephole_stats) {
+        print_peephole_stats(ctx->diag);
+    }
+    print_stats(ctx->diag);
+}
+
+static void *compile_thread(void *arg) {
+    ctx = arg;
+    FILE *out = ctx->out;
+    jmp_buf env;
+    ctx->on_error = &env;
+    if (setjmp(env)) {
+        // The output may have been redirected for the cache
+        ctx->out = out;
+        if (ctx->cache_out) {
+            fclose(ctx->cache_out);
+            ctx->cache_out = NULL;
+        }
+        free(ctx->cache_buf);
+        ctx->cache_buf = NULL;
+        arena_release();
+        return NULL;
+    }
+    run_passes();
+    arena_release();
+    return ctx;
+}
+
+// Compiles the translation unit `c` describes, and returns false if it
+// has errors.
+bool compile(Context *c) {
+    if (!c->diag) {
+        c->diag = stderr;
+    }
+
+    pthread_t thread;
+    void *ret;
+    if (pthread_create(&thread, NULL, compile_thread, c) ||
+        pthread_join(thread, &ret)) {
+        fprintf(c->diag, "cannot start a compilation thread\n");
+        return false;
+    }
+    return ret != NULL;
+}
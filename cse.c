@@ -0,0 +1,396 @@
+// Common subexpression elimination by local value numbering.
+//
+// Within a run of statements without control flow between them, every
+// subtree is given a value number in the order the code generator
+// evaluates it. Two subtrees get the same number only if they compute
+// the same value: numbers of variables change when the variables are
+// assigned, and numbers of loads change on stores and function calls.
+// A subtree that is computed more than once is stored to a temporary
+// when it is first evaluated and read from the temporary afterwards.
+#include "ncc.h"
+
+// Smallest subtree worth keeping in a temporary, in nodes
+#define MIN_CSE_COST 4
+
+// An evaluation of a subtree
+typedef struct {
+    Node *node;
+    int vn;       // Value number
+    int start;    // Index of the first evaluation inside the subtree
+    int cost;     // Number of nodes in the subtree
+    bool removed; // Inside a subtree replaced by a temporary
+} Eval;
+
+static _Thread_local Obj *current_fn;
+
+// Evaluations of the current run in the order they happen. The
+// evaluations inside a subtree immediately precede the subtree's own.
+static _Thread_local Eval *evals;
+static _Thread_local int nevals;
+static _Thread_local int capacity;
+
+// Map from a description of a value to its number
+static _Thread_local HashMap values;
+static _Thread_local int nvalues;
+
+// Versions of variables, keyed by address
+static _Thread_local HashMap versions;
+
+// Incremented by anything that may write to memory
+static _Thread_local int mem_epoch;
+
+// Incremented by anything the pass does not look into, so that no
+// value is reused across it
+static _Thread_local int barrier;
+
+// Statement lists found inside expressions, optimized after the run
+static _Thread_local Node **nested;
+static _Thread_local int nnested;
+static _Thread_local int nested_capacity;
+
+static _Thread_local int temp_id;
+
+static void cse_list(Node *node, Scope *sc);
+static void cse_stmt(Node *node, Scope *sc);
+
+static bool may_alias(Obj *var) {
+    return !var->is_local || var->addr_taken;
+}
+
+static char *var_key(Obj *var) {
+    return format("%p", var);
+}
+
+static int version(Obj *var) {
+    return (int)(intptr_t)hashmap_get(&versions, var_key(var));
+}
+
+static void kill_var(Obj *var) {
+    hashmap_put(&versions, var_key(var), (void *)(intptr_t)(version(var) + 1));
+    if (may_alias(var)) {
+        mem_epoch++;
+    }
+}
+
+static int value_number(char *key) {
+    key = format("%d %s", barrier, key);
+    int vn = (int)(intptr_t)hashmap_get(&values, key);
+    if (!vn) {
+        vn = ++nvalues;
+        hashmap_put(&values, key, (void *)(intptr_t)vn);
+    }
+    return vn;
+}
+
+static void add_eval(Node *node, int vn, int start, int cost) {
+    if (nevals == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        evals = arena_realloc(evals, sizeof(Eval) * capacity);
+    }
+    evals[nevals++] = (Eval){node, vn, start, cost, false};
+}
+
+static void add_nested(Node *node) {
+    if (nnested == nested_capacity) {
+        nested_capacity = nested_capacity ? nested_capacity * 2 : 8;
+        nested = arena_realloc(nested, sizeof(Node *) * nested_capacity);
+    }
+    nested[nnested++] = node;
+}
+
+static int number(Node *node, int *cost);
+
+// Numbers the subexpressions evaluated to compute the address of an
+// lvalue.
+static void number_addr(Node *node) {
+    int cost;
+    if (node->kind == ND_DEREF) {
+        number(node->lhs, &cost);
+    }
+}
+
+// Returns the value number of a given expression, or 0 if it has a side
+// effect or cannot be reused.
+static int number(Node *node, int *cost) {
+    int start = nevals;
+    int c1 = 0, c2 = 0;
+    char *key;
+
+    switch (node->kind) {
+    case ND_NUM:
+        *cost = 1;
+        return value_number(format("num %d", node->val));
+    case ND_VAR:
+        *cost = 1;
+        if (node->var->ty->kind == TY_ARRAY) {
+            return value_number(format("addr %p", node->var));
+        }
+        return value_number(format("var %p %d %d", node->var, version(node->var),
+                                   may_alias(node->var) ? mem_epoch : 0));
+    case ND_ADDR: {
+        if (node->lhs->kind == ND_VAR) {
+            *cost = 2;
+            return value_number(format("addr %p", node->lhs->var));
+        }
+        // &*p is p
+        int vn = number(node->lhs->lhs, &c1);
+        *cost = c1 + 2;
+        return vn;
+    }
+    case ND_DEREF: {
+        int vn = number(node->lhs, &c1);
+        if (!vn) {
+            return 0;
+        }
+        // An array is not loaded; its value is its address.
+        bool is_load = node->ty->kind != TY_ARRAY;
+        key = format("deref %d %d %d", vn, node->ty->kind, is_load ? mem_epoch : 0);
+        break;
+    }
+    case ND_NEG: {
+        int vn = number(node->lhs, &c1);
+        if (!vn) {
+            return 0;
+        }
+        key = format("neg %d", vn);
+        break;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE: {
+        // The right-hand side is evaluated first
+        int r = number(node->rhs, &c2);
+        int l = number(node->lhs, &c1);
+        if (!l || !r) {
+            return 0;
+        }
+        key = format("%d %d %d %d", node->kind, l, r, node->ty->kind);
+        break;
+    }
+    case ND_ASSIGN:
+        if (node->lhs->kind == ND_VAR) {
+            number(node->rhs, &c1);
+            kill_var(node->lhs->var);
+        } else {
+            number_addr(node->lhs);
+            number(node->rhs, &c1);
+            mem_epoch++;
+        }
+        return 0;
+    case ND_FUNCALL:
+        for (Node *arg = node->args; arg; arg = arg->next) {
+            number(arg, &c1);
+        }
+        mem_epoch++;
+        return 0;
+    default:
+        // Statement expressions and vector operations
+        add_nested(node);
+        barrier++;
+        mem_epoch++;
+        return 0;
+    }
+
+    if (!node->ty) {
+        return 0;
+    }
+    int vn = value_number(key);
+    *cost = c1 + c2 + 1;
+    add_eval(node, vn, start, *cost);
+    return vn;
+}
+
+static Obj *new_temp(Type *ty, Scope *sc) {
+    if (ty->kind == TY_ARRAY) {
+        ty = pointer_to(ty->base);
+    }
+    return add_lvar(current_fn, sc, format(".L.cse.%d", temp_id++), ty);
+}
+
+static Node *new_var_expr(Obj *var, Token *tok) {
+    Node *node = new_var_node(var, tok);
+    node->ty = var->ty;
+    return node;
+}
+
+// Marks the evaluations inside a subtree that is no longer computed
+static void remove_subtree(int i) {
+    for (int j = evals[i].start; j <= i; j++) {
+        evals[j].removed = true;
+    }
+}
+
+static int cmp_cost(const void *a, const void *b) {
+    Eval *x = *(Eval **)a;
+    Eval *y = *(Eval **)b;
+    if (x->cost != y->cost) {
+        return y->cost - x->cost;
+    }
+    return x - y;
+}
+
+// Replaces repeated evaluations in the current run, larger subtrees
+// first so that their parts are not kept in temporaries needlessly.
+static void eliminate(Scope *sc) {
+    Eval **order = arena_calloc(nevals, sizeof(Eval *));
+    int n = 0;
+    for (int i = 0; i < nevals; i++) {
+        if (evals[i].cost >= MIN_CSE_COST) {
+            order[n++] = &evals[i];
+        }
+    }
+    qsort(order, n, sizeof(Eval *), cmp_cost);
+
+    for (int k = 0; k < n; k++) {
+        Eval *first = order[k];
+        if (first->removed) {
+            continue;
+        }
+
+        // Only the first live evaluation of a value is kept
+        int i = first - evals;
+        bool is_first = true;
+        for (int j = 0; j < i; j++) {
+            if (!evals[j].removed && evals[j].vn == first->vn) {
+                is_first = false;
+                break;
+            }
+        }
+        if (!is_first) {
+            continue;
+        }
+
+        Obj *tmp = NULL;
+        for (int j = i + 1; j < nevals; j++) {
+            Eval *e = &evals[j];
+            if (e->removed || e->vn != first->vn) {
+                continue;
+            }
+            if (!tmp) {
+                tmp = new_temp(first->node->ty, sc);
+            }
+            remove_subtree(j);
+
+            // expr  =>  tmp
+            Node *next = e->node->next;
+            *e->node = *new_var_expr(tmp, e->node->tok);
+            e->node->next = next;
+        }
+        if (!tmp) {
+            continue;
+        }
+
+        // expr  =>  (tmp = expr)
+        Node *expr = arena_calloc(1, sizeof(Node));
+        *expr = *first->node;
+        expr->next = NULL;
+        Node *next = first->node->next;
+        *first->node = *new_binary(ND_ASSIGN, new_var_expr(tmp, expr->tok), expr, expr->tok);
+        first->node->ty = tmp->ty;
+        first->node->next = next;
+        first->node = expr;
+    }
+}
+
+// Optimizes the run of statements numbered so far, then the statement
+// lists found inside them.
+static void end_run(Scope *sc) {
+    eliminate(sc);
+    nevals = 0;
+    hashmap_clear(&values);
+
+    Node **list = nested;
+    int n = nnested;
+    nested = NULL;
+    nnested = nested_capacity = 0;
+    for (int i = 0; i < n; i++) {
+        if (list[i]->kind == ND_STMT_EXPR) {
+            cse_list(list[i]->body, list[i]->scope);
+        }
+    }
+}
+
+// Numbers an expression that is evaluated on its own, such as the
+// condition of a loop, which runs again after the loop body
+static void cse_expr(Node *node, Scope *sc) {
+    int cost;
+    end_run(sc);
+    number(node, &cost);
+    end_run(sc);
+}
+
+// Optimizes a statement that runs only on some paths, such as a branch
+// of an "if" or the body of a loop, apart from the code around it
+static void cse_branch(Node *node, Scope *sc) {
+    end_run(sc);
+    cse_stmt(node, sc);
+    end_run(sc);
+}
+
+static void cse_stmt(Node *node, Scope *sc) {
+    int cost;
+
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+        number(node->lhs, &cost);
+        return;
+    case ND_RET_STMT:
+        number(node->lhs, &cost);
+        end_run(sc);
+        return;
+    case ND_IF_STMT:
+        number(node->cond, &cost);
+        cse_branch(node->then, sc);
+        if (node->els) {
+            cse_branch(node->els, sc);
+        }
+        return;
+    case ND_FOR_STMT:
+        if (node->init) {
+            number(node->init, &cost);
+        }
+        if (node->cond) {
+            cse_expr(node->cond, sc);
+        }
+        cse_branch(node->then, sc);
+        if (node->update) {
+            cse_expr(node->update, sc);
+        }
+        return;
+    case ND_WHILE_STMT:
+        if (node->cond) {
+            cse_expr(node->cond, sc);
+        }
+        cse_branch(node->then, sc);
+        return;
+    case ND_BLOCK:
+        end_run(sc);
+        cse_list(node->body, node->scope ? node->scope : sc);
+        return;
+    }
+
+    end_run(sc);
+}
+
+static void cse_list(Node *node, Scope *sc) {
+    for (Node *n = node; n; n = n->next) {
+        cse_stmt(n, sc);
+    }
+    end_run(sc);
+}
+
+void eliminate_common_subexprs(Obj *prog) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function || fn->cached_asm) {
+            continue;
+        }
+        current_fn = fn;
+        hashmap_clear(&versions);
+        cse_list(fn->body->body, fn->body->scope);
+    }
+}
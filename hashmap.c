@@ -0,0 +1,96 @@
+// Open-addressing hash map with string keys
+#include "ncc.h"
+
+#define INIT_SIZE 16
+#define HIGH_WATERMARK 70
+
+uint64_t fnv_hash(char *s, int len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < len; i++) {
+        hash *= 0x100000001b3;
+        hash ^= (unsigned char)s[i];
+    }
+    return hash;
+}
+
+static void rehash(HashMap *map) {
+    int cap = map->capacity * 2;
+    if (cap < INIT_SIZE) {
+        cap = INIT_SIZE;
+    }
+
+    HashMap map2 = {};
+    map2.buckets = arena_calloc(cap, sizeof(HashEntry));
+    map2.capacity = cap;
+
+    for (int i = 0; i < map->capacity; i++) {
+        HashEntry *ent = &map->buckets[i];
+        if (ent->key) {
+            hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+        }
+    }
+    *map = map2;
+}
+
+static bool match(HashEntry *ent, char *key, int keylen) {
+    return ent->keylen == keylen && !memcmp(ent->key, key, keylen);
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+    if (!map->buckets) {
+        return NULL;
+    }
+
+    uint64_t hash = fnv_hash(key, keylen);
+    for (int i = 0; i < map->capacity; i++) {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (!ent->key) {
+            return NULL;
+        }
+        if (match(ent, key, keylen)) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+void *hashmap_get(HashMap *map, char *key) {
+    return hashmap_get2(map, key, strlen(key));
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen) {
+    HashEntry *ent = get_entry(map, key, keylen);
+    return ent ? ent->val : NULL;
+}
+
+void hashmap_put(HashMap *map, char *key, void *val) {
+    hashmap_put2(map, key, strlen(key), val);
+}
+
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val) {
+    if (!map->buckets || (map->used + 1) * 100 / map->capacity >= HIGH_WATERMARK) {
+        rehash(map);
+    }
+
+    uint64_t hash = fnv_hash(key, keylen);
+    for (int i = 0; i < map->capacity; i++) {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (ent->key && match(ent, key, keylen)) {
+            ent->val = val;
+            return;
+        }
+        if (!ent->key) {
+            ent->key = key;
+            ent->keylen = keylen;
+            ent->val = val;
+            map->used++;
+            return;
+        }
+    }
+    unreachable();
+}
+
+// The buckets belong to the arena, so they are simply dropped
+void hashmap_clear(HashMap *map) {
+    *map = (HashMap){};
+}
@@ -0,0 +1,346 @@
+// Incremental recompilation of functions.
+//
+// A compilation whose Context has a FunctionCache stores the assembly of
+// each function in it under a fingerprint of everything that assembly
+// depends on, and reuses the assembly of the previous compilation for
+// every function whose fingerprint did not change. The file is still
+// parsed as a whole, but the loop optimizer, CSE and code generation run
+// only for the functions that changed. `ncc --watch` keeps one cache for
+// all the compilations of the file it watches.
+//
+// The fingerprint of a function covers the options, its tokens (and
+// their lines with -g) and the names and types of the globals it uses.
+// With inlining, it also covers the functions it calls directly or
+// indirectly, whose bodies may end up in its own, and the functions of a
+// cycle of calls depend on one another. Labels are named after their
+// function and string literals after their contents, so reused assembly
+// stays valid whatever changes around it.
+//
+// Profile counters are numbered across the whole file, so reuse is off
+// with -fprofile-generate and -fprofile-use.
+#include "ncc.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+typedef struct {
+    uint64_t fingerprint;
+    char *text; // From malloc, or NULL if the slot is free
+} CacheEntry;
+
+// Open-addressing table of assembly by fingerprint
+typedef struct {
+    CacheEntry *entries;
+    int capacity;
+    int used;
+} CacheTable;
+
+struct FunctionCache {
+    CacheTable current; // Functions of the last successful compilation
+    CacheTable next;    // Functions of the compilation in progress
+    int reused;         // Functions reused by the compilation in progress
+    int compiled;       // Functions generated by it
+    int last_reused;    // The same for the last successful compilation
+    int last_compiled;
+};
+
+// A function of the translation unit being fingerprinted
+typedef struct FunctionInfo FunctionInfo;
+struct FunctionInfo {
+    Obj *fn;
+    uint64_t hash;        // Hash of the function alone
+    uint64_t fingerprint; // Hash of the function and all it calls
+    FunctionInfo **callees;
+    int ncallees;
+    int callee_capacity;
+
+    // Tarjan's algorithm for strongly connected components
+    int index;
+    int lowlink;
+    bool on_stack;
+};
+
+static _Thread_local HashMap infos;
+static _Thread_local FunctionInfo **stack;
+static _Thread_local int stack_len;
+static _Thread_local int next_index;
+
+FunctionCache *new_function_cache(void) {
+    return calloc(1, sizeof(FunctionCache));
+}
+
+void function_cache_counts(FunctionCache *cache, int *reused, int *compiled) {
+    *reused = cache->last_reused;
+    *compiled = cache->last_compiled;
+}
+
+static CacheEntry *find_entry(CacheTable *t, uint64_t fingerprint) {
+    if (!t->capacity) {
+        return NULL;
+    }
+    for (int i = fingerprint & (t->capacity - 1);; i = (i + 1) & (t->capacity - 1)) {
+        CacheEntry *e = &t->entries[i];
+        if (!e->text || e->fingerprint == fingerprint) {
+            return e;
+        }
+    }
+}
+
+static void add_entry(CacheTable *t, uint64_t fingerprint, char *text) {
+    // Keep the table at most half full
+    if ((t->used + 1) * 2 > t->capacity) {
+        CacheTable bigger = {};
+        bigger.capacity = t->capacity ? t->capacity * 2 : 64;
+        bigger.entries = calloc(bigger.capacity, sizeof(CacheEntry));
+        for (int i = 0; i < t->capacity; i++) {
+            if (t->entries[i].text) {
+                *find_entry(&bigger, t->entries[i].fingerprint) = t->entries[i];
+                bigger.used++;
+            }
+        }
+        free(t->entries);
+        *t = bigger;
+    }
+
+    CacheEntry *e = find_entry(t, fingerprint);
+    if (e->text) {
+        return;
+    }
+    *e = (CacheEntry){fingerprint, text};
+    t->used++;
+}
+
+// Frees a table along with the assembly that `keep` does not share
+static void drop_table(CacheTable *t, CacheTable *keep) {
+    for (int i = 0; i < t->capacity; i++) {
+        CacheEntry *e = &t->entries[i];
+        if (!e->text) {
+            continue;
+        }
+        CacheEntry *kept = find_entry(keep, e->fingerprint);
+        if (!kept || kept->text != e->text) {
+            free(e->text);
+        }
+    }
+    free(t->entries);
+    *t = (CacheTable){};
+}
+
+static uint64_t hash_bytes(uint64_t h, char *p, int len) {
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t hash_int(uint64_t h, uint64_t val) {
+    return hash_bytes(h, (char *)&val, sizeof(val));
+}
+
+static uint64_t hash_string(uint64_t h, char *s) {
+    // The terminator keeps adjacent strings apart
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static uint64_t hash_type(uint64_t h, Type *ty) {
+    for (; ty; ty = ty->base) {
+        h = hash_int(h, ty->kind);
+        h = hash_int(h, ty->size);
+        h = hash_int(h, ty->array_len);
+    }
+    return h;
+}
+
+static void add_callee(FunctionInfo *info, FunctionInfo *callee) {
+    if (info->ncallees == info->callee_capacity) {
+        info->callee_capacity = info->callee_capacity ? info->callee_capacity * 2 : 8;
+        info->callees = arena_realloc(info->callees,
+                                      sizeof(FunctionInfo *) * info->callee_capacity);
+    }
+    info->callees[info->ncallees++] = callee;
+}
+
+// Hashes the globals that a function uses and records its callees
+static uint64_t hash_uses(uint64_t h, FunctionInfo *info, Node *node) {
+    if (!node) {
+        return h;
+    }
+    if (node->kind == ND_VAR && !node->var->is_local) {
+        h = hash_string(h, node->var->name);
+        h = hash_type(h, node->var->ty);
+    }
+    if (node->kind == ND_FUNCALL && opt_inline_limit > 0) {
+        FunctionInfo *callee = hashmap_get(&infos, node->funcname);
+        if (callee) {
+            add_callee(info, callee);
+        }
+    }
+
+    h = hash_uses(h, info, node->lhs);
+    h = hash_uses(h, info, node->rhs);
+    h = hash_uses(h, info, node->cond);
+    h = hash_uses(h, info, node->then);
+    h = hash_uses(h, info, node->els);
+    h = hash_uses(h, info, node->init);
+    h = hash_uses(h, info, node->update);
+    for (Node *n = node->body; n; n = n->next) {
+        h = hash_uses(h, info, n);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        h = hash_uses(h, info, n);
+    }
+    return h;
+}
+
+static uint64_t hash_function(FunctionInfo *info, uint64_t options) {
+    uint64_t h = options;
+    for (Token *tok = info->fn->tok_begin; tok != info->fn->tok_end; tok = tok->next) {
+        h = hash_bytes(h, tok->loc, tok->len);
+        h = hash_bytes(h, "", 1);
+        if (opt_debug_info) {
+            h = hash_int(h, tok->line_no);
+        }
+    }
+    return hash_uses(h, info, info->fn->body);
+}
+
+// Fingerprints the strongly connected component of the call graph that
+// `info` belongs to. The fingerprint covers the functions of the
+// component and the fingerprints of the components they call.
+static void visit(FunctionInfo *info) {
+    info->index = info->lowlink = ++next_index;
+    stack[stack_len++] = info;
+    info->on_stack = true;
+
+    for (int i = 0; i < info->ncallees; i++) {
+        FunctionInfo *callee = info->callees[i];
+        if (!callee->index) {
+            visit(callee);
+            if (info->lowlink > callee->lowlink) {
+                info->lowlink = callee->lowlink;
+            }
+        } else if (callee->on_stack && info->lowlink > callee->index) {
+            info->lowlink = callee->index;
+        }
+    }
+
+    if (info->lowlink != info->index) {
+        return;
+    }
+
+    // The component is `info` and everything above it on the stack
+    int start = stack_len;
+    do {
+        start--;
+    } while (stack[start] != info);
+
+    uint64_t h = FNV_OFFSET;
+    for (int i = start; i < stack_len; i++) {
+        h = hash_int(h, stack[i]->hash);
+    }
+    for (int i = start; i < stack_len; i++) {
+        for (int j = 0; j < stack[i]->ncallees; j++) {
+            FunctionInfo *callee = stack[i]->callees[j];
+            if (!callee->on_stack) {
+                h = hash_int(h, callee->fingerprint);
+            }
+        }
+    }
+    for (int i = start; i < stack_len; i++) {
+        // Functions of one component share everything but themselves
+        stack[i]->fingerprint = hash_int(h, stack[i]->hash);
+        stack[i]->on_stack = false;
+    }
+    stack_len = start;
+}
+
+// Fingerprints the functions of `prog`, and marks those whose assembly
+// the previous compilation left in the cache to be reused
+void reuse_functions(Obj *prog) {
+    FunctionCache *cache = ctx->fn_cache;
+
+    // Forget a compilation that failed
+    drop_table(&cache->next, &cache->current);
+    cache->reused = 0;
+    cache->compiled = 0;
+
+    uint64_t options = FNV_OFFSET;
+    for (char **flag = ctx->flags; flag && *flag; flag++) {
+        options = hash_string(options, *flag);
+    }
+
+    hashmap_clear(&infos);
+    int nfuncs = 0;
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function) {
+            FunctionInfo *info = arena_calloc(1, sizeof(FunctionInfo));
+            info->fn = fn;
+            hashmap_put(&infos, fn->name, info);
+            nfuncs++;
+        }
+    }
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function) {
+            FunctionInfo *info = hashmap_get(&infos, fn->name);
+            info->hash = hash_function(info, options);
+        }
+    }
+
+    stack = arena_calloc(nfuncs, sizeof(FunctionInfo *));
+    stack_len = 0;
+    next_index = 0;
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function) {
+            continue;
+        }
+        FunctionInfo *info = hashmap_get(&infos, fn->name);
+        if (!info->index) {
+            visit(info);
+        }
+
+        CacheEntry *e = find_entry(&cache->current, info->fingerprint);
+        if (e && e->text) {
+            fn->cached_asm = e->text;
+            add_entry(&cache->next, info->fingerprint, e->text);
+        }
+    }
+}
+
+// Writes the reused assembly of a function to the output
+void reuse_function_asm(Obj *fn) {
+    fputs(fn->cached_asm, ctx->out);
+    ctx->fn_cache->reused++;
+}
+
+// Writes the assembly of a function that was just generated to the
+// output, and keeps a copy in the cache
+void save_function_asm(Obj *fn) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    flush_insts(out);
+    fclose(out);
+    fwrite(buf, 1, buflen, ctx->out);
+
+    ctx->fn_cache->compiled++;
+    FunctionInfo *info = hashmap_get(&infos, fn->name);
+    if (info) {
+        add_entry(&ctx->fn_cache->next, info->fingerprint, buf);
+    } else {
+        free(buf);
+    }
+}
+
+// Makes the functions of the compilation that just succeeded those the
+// next one may reuse
+void commit_functions(void) {
+    FunctionCache *cache = ctx->fn_cache;
+    drop_table(&cache->current, &cache->next);
+    cache->current = cache->next;
+    cache->next = (CacheTable){};
+    cache->last_reused = cache->reused;
+    cache->last_compiled = cache->compiled;
+    cache->reused = 0;
+    cache->compiled = 0;
+}
@@ -0,0 +1,420 @@
+// Inliner for small functions within a translation unit.
+//
+// A call to a function whose body is small and ends with its only return
+// statement is replaced with a statement expression that assigns the
+// arguments to copies of the parameters, followed by a copy of the
+// callee's body with all of its locals renamed into the caller.
+#include "ncc.h"
+
+#define MAX_INLINE_DEPTH 8
+
+// Functions that the profile shows to be hot may be this many times
+// larger than the inline limit
+#define HOT_INLINE_FACTOR 4
+
+// Function the calls are inlined into
+static _Thread_local Obj *caller;
+
+// Functions defined in this translation unit
+static _Thread_local HashMap functions;
+
+// Functions being expanded, to guard against (mutual) recursion
+static _Thread_local Obj *inline_stack[MAX_INLINE_DEPTH];
+static _Thread_local int inline_depth;
+
+static _Thread_local int unique_id;
+
+// Mapping from callee's variables and scopes to their copies. A
+// parameter may be replaced by its argument expression instead.
+static _Thread_local Obj **var_from;
+static _Thread_local Obj **var_to;
+static _Thread_local Node **var_subst;
+static _Thread_local int nvars;
+static _Thread_local int var_capacity;
+
+static _Thread_local Scope **scope_from;
+static _Thread_local Scope **scope_to;
+static _Thread_local int nscopes;
+static _Thread_local int scope_capacity;
+
+static void walk(Node *node, Scope *sc);
+
+static int count_nodes(Node *node) {
+    if (!node) {
+        return 0;
+    }
+
+    int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+            count_nodes(node->cond) + count_nodes(node->then) +
+            count_nodes(node->els) + count_nodes(node->init) +
+            count_nodes(node->update);
+    for (Node *n2 = node->body; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    for (Node *n2 = node->args; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    return n;
+}
+
+static bool has_return(Node *node) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == ND_RET_STMT) {
+        return true;
+    }
+
+    if (has_return(node->then) || has_return(node->els)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (has_return(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the last statement of a given block
+static Node *last_stmt(Node *block) {
+    Node *last = block->body;
+    while (last && last->next) {
+        last = last->next;
+    }
+    return last;
+}
+
+static bool can_inline(Node *node, Obj *callee) {
+    if (!callee || !callee->body || callee == caller) {
+        return false;
+    }
+    if (inline_depth == MAX_INLINE_DEPTH) {
+        return false;
+    }
+    for (int i = 0; i < inline_depth; i++) {
+        if (inline_stack[i] == callee) {
+            return false;
+        }
+    }
+
+    int nargs = 0;
+    int nparams = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+        nargs++;
+    }
+    for (Obj *var = callee->params; var; var = var->next) {
+        nparams++;
+    }
+    if (nargs != nparams) {
+        return false;
+    }
+
+    // The function must leave only through the return statement at the
+    // end of its body.
+    Node *last = last_stmt(callee->body);
+    if (!last || last->kind != ND_RET_STMT) {
+        return false;
+    }
+    for (Node *n = callee->body->body; n != last; n = n->next) {
+        if (has_return(n)) {
+            return false;
+        }
+    }
+
+    // The profile tells whether the call is worth the code growth
+    int limit = opt_inline_limit;
+    if (profile_count(callee->prof_id) == 0) {
+        return false;
+    }
+    if (profile_is_hot(callee->prof_id)) {
+        limit *= HOT_INLINE_FACTOR;
+    }
+    return count_nodes(callee->body) <= limit;
+}
+
+static int find_var(Obj *var) {
+    for (int i = 0; i < nvars; i++) {
+        if (var_from[i] == var) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static Obj *map_var(Obj *var) {
+    int i = find_var(var);
+    return (i == -1) ? var : var_to[i];
+}
+
+// Returns true if a given node may write to memory or call a function
+static bool has_side_effect(Node *node) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == ND_ASSIGN || node->kind == ND_FUNCALL) {
+        return true;
+    }
+
+    if (has_side_effect(node->lhs) || has_side_effect(node->rhs) ||
+        has_side_effect(node->cond) || has_side_effect(node->then) ||
+        has_side_effect(node->els) || has_side_effect(node->init) ||
+        has_side_effect(node->update)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (has_side_effect(n)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (has_side_effect(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Uses of a parameter can be replaced by its argument if the argument is
+// a constant or a variable that cannot change during the call, and
+// the callee neither assigns to the parameter nor takes its address.
+// Parameters are assigned only by statements with side effects, and a
+// caller's variable can only be changed by such statements, too.
+static bool can_substitute(Obj *param, Node *arg, Obj *callee) {
+    if (param->addr_taken || has_side_effect(callee->body)) {
+        return false;
+    }
+    if (arg->kind == ND_NUM) {
+        return param->ty->size == 8 || (-128 <= arg->val && arg->val < 128);
+    }
+    if (arg->kind == ND_VAR) {
+        return param->ty->size == arg->ty->size || arg->ty->kind == TY_ARRAY;
+    }
+    return false;
+}
+
+static Scope *map_scope(Scope *sc) {
+    for (int i = 0; i < nscopes; i++) {
+        if (scope_from[i] == sc) {
+            return scope_to[i];
+        }
+    }
+    return sc;
+}
+
+// Copies the variables of a scope, keeping their declaration order.
+static void clone_vars(Obj *callee, Obj *var, Scope *sc) {
+    if (!var) {
+        return;
+    }
+    clone_vars(callee, var->scope_next, sc);
+
+    char *name = format("%s.%s.%d", callee->name, var->name, unique_id);
+    if (nvars == var_capacity) {
+        var_capacity = var_capacity ? var_capacity * 2 : 16;
+        var_from = arena_realloc(var_from, sizeof(Obj *) * var_capacity);
+        var_to = arena_realloc(var_to, sizeof(Obj *) * var_capacity);
+        var_subst = arena_realloc(var_subst, sizeof(Node *) * var_capacity);
+    }
+    var_from[nvars] = var;
+    var_subst[nvars] = NULL;
+    var_to[nvars] = add_lvar(caller, sc, name, var->ty);
+    var_to[nvars++]->addr_taken = var->addr_taken;
+}
+
+static Scope *clone_scope(Obj *callee, Scope *orig, Scope *parent) {
+    Scope *sc = new_scope(parent);
+    if (nscopes == scope_capacity) {
+        scope_capacity = scope_capacity ? scope_capacity * 2 : 16;
+        scope_from = arena_realloc(scope_from, sizeof(Scope *) * scope_capacity);
+        scope_to = arena_realloc(scope_to, sizeof(Scope *) * scope_capacity);
+    }
+    scope_from[nscopes] = orig;
+    scope_to[nscopes++] = sc;
+
+    clone_vars(callee, orig->vars, sc);
+    for (Scope *child = orig->children; child; child = child->next) {
+        clone_scope(callee, child, sc);
+    }
+    return sc;
+}
+
+static Node *clone_node(Node *node);
+
+static Node *clone_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    for (Node *n = node; n; n = n->next) {
+        cur = cur->next = clone_node(n);
+    }
+    return head.next;
+}
+
+static Node *clone_node(Node *node) {
+    if (!node) {
+        return NULL;
+    }
+
+    if (node->kind == ND_VAR) {
+        int i = find_var(node->var);
+        if (i != -1 && var_subst[i]) {
+            return clone_node(var_subst[i]);
+        }
+    }
+
+    Node *copy = arena_calloc(1, sizeof(Node));
+    *copy = *node;
+    copy->next = NULL;
+    copy->lhs = clone_node(node->lhs);
+    copy->rhs = clone_node(node->rhs);
+    copy->cond = clone_node(node->cond);
+    copy->then = clone_node(node->then);
+    copy->els = clone_node(node->els);
+    copy->init = clone_node(node->init);
+    copy->update = clone_node(node->update);
+    copy->body = clone_list(node->body);
+    copy->args = clone_list(node->args);
+    if (node->var) {
+        copy->var = map_var(node->var);
+    }
+    if (node->scope) {
+        copy->scope = map_scope(node->scope);
+    }
+    return copy;
+}
+
+// Replaces a call node with a statement expression
+//
+//   ({ p1' = arg1; ...; pn' = argn; { body' } })
+//
+// where the last statement of the body, `return expr`, becomes `expr`.
+static void inline_call(Node *node, Obj *callee, Scope *sc) {
+    nvars = 0;
+    nscopes = 0;
+    unique_id++;
+
+    // The callee's variables live in a scope nested in the call site,
+    // so they never share a stack slot with a variable that is live
+    // across the call.
+    Scope *callee_sc = clone_scope(callee, callee->root_scope, sc);
+
+    Node *arg = node->args;
+    for (Obj *param = callee->params; param; param = param->next) {
+        if (can_substitute(param, arg, callee)) {
+            var_subst[find_var(param)] = arg;
+        }
+        arg = arg->next;
+    }
+
+    Node *body = clone_node(callee->body);
+    Node *ret = last_stmt(body);
+    ret->kind = ND_EXPR_STMT;
+
+    // `{ return expr; }` with all parameters substituted is just `expr`
+    bool all_subst = true;
+    for (int i = 0; i < nvars; i++) {
+        if (var_from[i]->scope == callee->root_scope && !var_subst[i]) {
+            all_subst = false;
+        }
+    }
+    if (all_subst && body->body == ret && !callee->body->scope->vars &&
+        !callee->body->scope->children) {
+        Node *expr = ret->lhs;
+        Node *next = node->next;
+        *node = *expr;
+        node->next = next;
+        inline_stack[inline_depth++] = callee;
+        walk(node, sc);
+        inline_depth--;
+        return;
+    }
+
+    Node head = {};
+    Node *cur = &head;
+    arg = node->args;
+    for (Obj *param = callee->params; param; param = param->next) {
+        Node *next = arg->next;
+        arg->next = NULL;
+        if (var_subst[find_var(param)]) {
+            arg = next;
+            continue;
+        }
+        Node *lhs = new_var_node(map_var(param), node->tok);
+        lhs->ty = lhs->var->ty;
+        Node *assign = new_binary(ND_ASSIGN, lhs, arg, node->tok);
+        assign->ty = lhs->ty;
+        cur = cur->next = new_unary(ND_EXPR_STMT, assign, node->tok);
+        arg = next;
+    }
+    cur->next = body;
+
+    // Calls in the arguments are evaluated while the parameter copies
+    // are being assigned.
+    for (Node *n = head.next; n != body; n = n->next) {
+        walk(n->lhs->rhs, callee_sc);
+    }
+
+    Type *ty = node->ty;
+    Node *next = node->next;
+    *node = (Node){ND_STMT_EXPR};
+    node->next = next;
+    node->tok = body->tok;
+    node->ty = ty;
+    node->body = head.next;
+    node->scope = callee_sc;
+
+    inline_stack[inline_depth++] = callee;
+    walk(body, callee_sc);
+    inline_depth--;
+}
+
+static void walk_list(Node *node, Scope *sc) {
+    for (Node *n = node; n; n = n->next) {
+        walk(n, sc);
+    }
+}
+
+static void walk(Node *node, Scope *sc) {
+    if (!node) {
+        return;
+    }
+    if (node->scope) {
+        sc = node->scope;
+    }
+
+    if (node->kind == ND_FUNCALL) {
+        Obj *callee = hashmap_get(&functions, node->funcname);
+        if (can_inline(node, callee)) {
+            inline_call(node, callee, sc);
+        } else {
+            walk_list(node->args, sc);
+        }
+        return;
+    }
+
+    walk(node->lhs, sc);
+    walk(node->rhs, sc);
+    walk(node->cond, sc);
+    walk(node->then, sc);
+    walk(node->els, sc);
+    walk(node->init, sc);
+    walk(node->update, sc);
+    walk_list(node->body, sc);
+    walk_list(node->args, sc);
+}
+
+void inline_functions(Obj *prog) {
+    hashmap_clear(&functions);
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function) {
+            hashmap_put(&functions, fn->name, fn);
+        }
+    }
+
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (fn->is_function) {
+            caller = fn;
+            walk(fn->body, fn->root_scope);
+        }
+    }
+}
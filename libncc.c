@@ -0,0 +1,46 @@
+// Implementation of libncc.h on top of compile().
+#include "ncc.h"
+#include "libncc.h"
+
+int ncc_compile(const char *src, size_t len, const NccOptions *opts,
+                NccOutput *out) {
+    NccOptions defaults = {};
+    if (!opts) {
+        opts = &defaults;
+    }
+
+    Context c = {};
+    c.filename = opts->filename ? (char *)opts->filename : "<input>";
+    c.source = (char *)src;
+    c.source_len = len;
+    c.flags = (char **)opts->flags;
+    c.diagnostic = opts->diagnostic;
+    c.diagnostic_arg = opts->arg;
+
+    char *reports;
+    size_t reports_len;
+    c.diag = open_memstream(&reports, &reports_len);
+    c.out = open_memstream(&out->data, &out->len);
+
+    bool ok = compile(&c);
+    fclose(c.out);
+    fclose(c.diag);
+
+    // Reports such as -ftime-report go the same way as errors
+    if (reports_len) {
+        if (opts->diagnostic) {
+            opts->diagnostic(reports, opts->arg);
+        } else {
+            fputs(reports, stderr);
+        }
+    }
+    free(reports);
+
+    if (!ok) {
+        free(out->data);
+        out->data = NULL;
+        out->len = 0;
+        return -1;
+    }
+    return 0;
+}
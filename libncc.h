@@ -0,0 +1,31 @@
+// Interface for compiling C in-process with ncc.
+//
+// The library holds no state between calls, and any number of threads
+// may compile at the same time.
+#ifndef LIBNCC_H
+#define LIBNCC_H
+
+#include <stddef.h>
+
+typedef struct {
+    const char *filename; // Name of the source in messages, or NULL
+    const char **flags;   // Command-line options such as "-O0", ended by NULL
+
+    // Called with each error message and report, or NULL to print them
+    // to stderr. Messages end with a newline.
+    void (*diagnostic)(const char *msg, void *arg);
+    void *arg;
+} NccOptions;
+
+typedef struct {
+    char *data; // Assembly, to be released with free()
+    size_t len;
+} NccOutput;
+
+// Compiles `len` bytes of source to assembly. Returns 0 on success, or
+// -1 if the source has errors, in which case `out` is empty. `opts` may
+// be NULL for the default options.
+int ncc_compile(const char *src, size_t len, const NccOptions *opts,
+                NccOutput *out);
+
+#endif
@@ -0,0 +1,1285 @@
+// Loop optimizations on `for` and `while` statements.
+//
+// Induction variable strength reduction: an address `base + (i + k) * size`
+// where `i` is a variable stepped by a constant in the loop's update
+// expression becomes a pointer variable that is computed once before the
+// loop and incremented by `step * size` at the end of each iteration.
+//
+// Loop-invariant code motion: expressions whose operands do not change
+// inside the loop are computed once into a temporary before the loop.
+//
+// Vectorization: an innermost loop whose body stores to and loads from
+// `a[i + k]` runs 16 bytes worth of iterations at a time using SSE2,
+// followed by the original loop for the remaining iterations.
+//
+// Unrolling: a loop over an induction variable with an invariant bound
+// runs several copies of its body per iteration, followed by a remainder
+// loop for the last iterations. A loop with a constant trip count and a
+// small body is replaced by straight-line copies of the body.
+#include "ncc.h"
+
+// Maximum number of nodes in the body of a partially unrolled loop
+#define MAX_UNROLLED_SIZE 256
+
+// Size of an SSE2 vector register in bytes
+#define VECTOR_SIZE 16
+
+// Limits of the vectorizer
+#define MAX_MEMREFS 16
+#define MAX_ALIAS_CHECKS 4
+#define MAX_VECTOR_DEPTH 8
+
+// Function being optimized
+static _Thread_local Obj *current_fn;
+
+// Summary of what a loop may modify
+typedef struct {
+    Obj **assigned; // Variables assigned in the loop
+    int nassigned;
+    int capacity;
+    bool has_store; // Stores through a pointer
+    bool has_call;  // Function calls
+} LoopInfo;
+
+// Statements to be run before the loop and at the end of its body
+typedef struct {
+    Node *preheader;
+    Node *latch;
+    Scope *scope; // Scope enclosing the loop, where temporaries live
+} LoopEdit;
+
+static _Thread_local int temp_id;
+
+static void add_assigned(LoopInfo *info, Obj *var) {
+    if (info->nassigned == info->capacity) {
+        info->capacity = info->capacity ? info->capacity * 2 : 8;
+        info->assigned = realloc(info->assigned, sizeof(Obj *) * info->capacity);
+    }
+    info->assigned[info->nassigned++] = var;
+}
+
+static void collect_info(Node *node, LoopInfo *info) {
+    if (!node) {
+        return;
+    }
+
+    if (node->kind == ND_ASSIGN) {
+        if (node->lhs->kind == ND_VAR) {
+            add_assigned(info, node->lhs->var);
+        } else {
+            info->has_store = true;
+        }
+    } else if (node->kind == ND_VSTORE) {
+        info->has_store = true;
+    } else if (node->kind == ND_FUNCALL) {
+        info->has_call = true;
+    }
+
+    collect_info(node->lhs, info);
+    collect_info(node->rhs, info);
+    collect_info(node->cond, info);
+    collect_info(node->then, info);
+    collect_info(node->els, info);
+    collect_info(node->init, info);
+    collect_info(node->update, info);
+    for (Node *n = node->body; n; n = n->next) {
+        collect_info(n, info);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        collect_info(n, info);
+    }
+}
+
+static bool is_assigned(LoopInfo *info, Obj *var) {
+    for (int i = 0; i < info->nassigned; i++) {
+        if (info->assigned[i] == var) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if the value of a variable cannot change inside the loop
+static bool is_invariant_var(LoopInfo *info, Obj *var) {
+    if (var->ty->kind == TY_ARRAY) {
+        return true; // An array evaluates to its address
+    }
+    if (is_assigned(info, var)) {
+        return false;
+    }
+    // A store through a pointer or a callee may modify globals and
+    // locals whose address is taken.
+    bool may_alias = !var->is_local || var->addr_taken;
+    return !may_alias || (!info->has_store && !info->has_call);
+}
+
+// Returns true if a given expression evaluates to the same value in every
+// iteration and can be evaluated before the loop without trapping.
+static bool is_invariant(LoopInfo *info, Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        return true;
+    case ND_VAR:
+        return is_invariant_var(info, node->var);
+    case ND_ADDR:
+        if (node->lhs->kind == ND_VAR) {
+            return true;
+        }
+        return node->lhs->kind == ND_DEREF && is_invariant(info, node->lhs->lhs);
+    case ND_DEREF:
+        // Dereferencing an array yields an address without loading memory
+        return node->ty->kind == TY_ARRAY && is_invariant(info, node->lhs);
+    case ND_NEG:
+        return is_invariant(info, node->lhs);
+    case ND_DIV:
+        // Division by zero or -1 may trap
+        if (node->rhs->kind != ND_NUM || node->rhs->val == 0 || node->rhs->val == -1) {
+            return false;
+        }
+        return is_invariant(info, node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_invariant(info, node->lhs) && is_invariant(info, node->rhs);
+    }
+    return false;
+}
+
+// Returns true if a given expression consists of only constants
+static bool is_const_expr(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+        return true;
+    case ND_NEG:
+        return is_const_expr(node->lhs);
+    case ND_DIV:
+        return node->rhs->kind == ND_NUM && node->rhs->val != 0 &&
+               is_integer(node->ty) && is_const_expr(node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_integer(node->ty) && is_const_expr(node->lhs) &&
+               is_const_expr(node->rhs);
+    }
+    return false;
+}
+
+static long eval(Node *node) {
+    switch (node->kind) {
+    case ND_NUM: return node->val;
+    case ND_NEG: return -eval(node->lhs);
+    case ND_ADD: return eval(node->lhs) + eval(node->rhs);
+    case ND_SUB: return eval(node->lhs) - eval(node->rhs);
+    case ND_MUL: return eval(node->lhs) * eval(node->rhs);
+    case ND_DIV: return eval(node->lhs) / eval(node->rhs);
+    case ND_EQ: return eval(node->lhs) == eval(node->rhs);
+    case ND_NE: return eval(node->lhs) != eval(node->rhs);
+    case ND_LT: return eval(node->lhs) < eval(node->rhs);
+    case ND_LE: return eval(node->lhs) <= eval(node->rhs);
+    }
+    unreachable();
+}
+
+// Returns true if computing a given expression takes more than a single
+// instruction, so that keeping it in a variable pays off.
+static bool is_worth_hoisting(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_VAR:
+        return false;
+    case ND_ADDR:
+        return node->lhs->kind != ND_VAR;
+    case ND_DEREF:
+        return is_worth_hoisting(node->lhs);
+    }
+    return true;
+}
+
+static Obj *new_temp(LoopEdit *edit, Type *ty) {
+    // A temporary holds the address of an array rather than the array
+    if (ty->kind == TY_ARRAY) {
+        ty = pointer_to(ty->base);
+    }
+    return add_lvar(current_fn, edit->scope, format(".L.tmp.%d", temp_id++), ty);
+}
+
+static Node *new_var_expr(Obj *var, Token *tok) {
+    Node *node = new_var_node(var, tok);
+    node->ty = var->ty;
+    return node;
+}
+
+static Node *new_assign_stmt(Obj *var, Node *rhs, Token *tok) {
+    Node *node = new_binary(ND_ASSIGN, new_var_expr(var, tok), rhs, tok);
+    node->ty = var->ty;
+    return new_unary(ND_EXPR_STMT, node, tok);
+}
+
+static void append(Node **list, Node *node) {
+    while (*list) {
+        list = &(*list)->next;
+    }
+    *list = node;
+}
+
+//
+// Strength reduction
+//
+
+static bool same_expr(Node *a, Node *b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    if (a->kind != b->kind) {
+        return false;
+    }
+
+    switch (a->kind) {
+    case ND_NUM:
+        return a->val == b->val;
+    case ND_VAR:
+        return a->var == b->var;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+        return same_expr(a->lhs, b->lhs);
+    }
+    return false;
+}
+
+// A basic induction variable `i` updated by `i = i + step` or `i = i - step`
+typedef struct {
+    Obj *var;
+    int step;
+} InductionVar;
+
+static bool find_induction_var(Node *update, LoopInfo *info, InductionVar *iv) {
+    if (!update || update->kind != ND_ASSIGN || update->lhs->kind != ND_VAR) {
+        return false;
+    }
+
+    Obj *var = update->lhs->var;
+    Node *rhs = update->rhs;
+    if (!var->is_local || var->addr_taken || !is_integer(var->ty) ||
+        var->ty->size != 8) {
+        return false;
+    }
+    if ((rhs->kind != ND_ADD && rhs->kind != ND_SUB) ||
+        rhs->lhs->kind != ND_VAR || rhs->lhs->var != var ||
+        rhs->rhs->kind != ND_NUM) {
+        return false;
+    }
+
+    // The update expression must be the only assignment to the variable
+    int n = 0;
+    for (int i = 0; i < info->nassigned; i++) {
+        if (info->assigned[i] == var) {
+            n++;
+        }
+    }
+    if (n != 1) {
+        return false;
+    }
+
+    iv->var = var;
+    iv->step = (rhs->kind == ND_ADD) ? rhs->rhs->val : -rhs->rhs->val;
+    return true;
+}
+
+// Returns true if a given expression is `i`, `i + k`, `k + i` or `i - k`
+// for a loop invariant `k`.
+static bool is_affine(Node *node, InductionVar *iv, LoopInfo *info) {
+    if (node->kind == ND_VAR) {
+        return node->var == iv->var;
+    }
+    if (node->kind == ND_ADD) {
+        return (is_affine(node->lhs, iv, info) && is_invariant(info, node->rhs)) ||
+               (is_affine(node->rhs, iv, info) && is_invariant(info, node->lhs));
+    }
+    if (node->kind == ND_SUB) {
+        return is_affine(node->lhs, iv, info) && is_invariant(info, node->rhs);
+    }
+    return false;
+}
+
+// Derived induction variable, a pointer that advances with `i`
+typedef struct DerivedIV DerivedIV;
+struct DerivedIV {
+    DerivedIV *next;
+    Node *addr; // base + idx * size
+    Obj *ptr;
+};
+
+// Matches `base + idx * size` where `base` is an invariant pointer and
+// `idx` is affine in the induction variable.
+static bool is_derived_iv(Node *node, InductionVar *iv, LoopInfo *info) {
+    return node->kind == ND_ADD && node->ty->base &&
+           node->rhs->kind == ND_MUL && node->rhs->rhs->kind == ND_NUM &&
+           is_invariant(info, node->lhs) && is_affine(node->rhs->lhs, iv, info);
+}
+
+static void reduce(Node **pnode, InductionVar *iv, LoopInfo *info,
+                   LoopEdit *edit, DerivedIV **divs) {
+    Node *node = *pnode;
+    if (!node) {
+        return;
+    }
+
+    if (is_derived_iv(node, iv, info)) {
+        DerivedIV *div = *divs;
+        while (div && !same_expr(div->addr, node)) {
+            div = div->next;
+        }
+
+        if (!div) {
+            div = arena_calloc(1, sizeof(DerivedIV));
+            div->addr = node;
+            div->ptr = new_temp(edit, node->ty);
+            div->next = *divs;
+            *divs = div;
+            add_assigned(info, div->ptr);
+
+            // ptr = base + idx * size;
+            Node *next = node->next;
+            node->next = NULL;
+            append(&edit->preheader, new_assign_stmt(div->ptr, node, node->tok));
+            node->next = next;
+
+            // ptr = ptr + step * size;
+            Node *inc = new_binary(ND_ADD, new_var_expr(div->ptr, node->tok),
+                                   new_num(iv->step * node->rhs->rhs->val, node->tok),
+                                   node->tok);
+            inc->ty = div->ptr->ty;
+            append(&edit->latch, new_assign_stmt(div->ptr, inc, node->tok));
+        }
+
+        *pnode = new_var_expr(div->ptr, node->tok);
+        (*pnode)->next = node->next;
+        node->next = NULL;
+        return;
+    }
+
+    reduce(&node->lhs, iv, info, edit, divs);
+    reduce(&node->rhs, iv, info, edit, divs);
+    reduce(&node->cond, iv, info, edit, divs);
+    reduce(&node->then, iv, info, edit, divs);
+    reduce(&node->els, iv, info, edit, divs);
+    reduce(&node->init, iv, info, edit, divs);
+    reduce(&node->update, iv, info, edit, divs);
+    for (Node **n = &node->body; *n; n = &(*n)->next) {
+        reduce(n, iv, info, edit, divs);
+    }
+    for (Node **n = &node->args; *n; n = &(*n)->next) {
+        reduce(n, iv, info, edit, divs);
+    }
+}
+
+static void reduce_strength(Node *node, LoopInfo *info, LoopEdit *edit) {
+    InductionVar iv;
+    if (!find_induction_var(node->update, info, &iv)) {
+        return;
+    }
+
+    DerivedIV *divs = NULL;
+    reduce(&node->then, &iv, info, edit, &divs);
+}
+
+//
+// Loop-invariant code motion
+//
+
+static void hoist(Node **pnode, LoopInfo *info, LoopEdit *edit);
+
+static void hoist_lvalue(Node *node, LoopInfo *info, LoopEdit *edit) {
+    if (node->kind == ND_DEREF) {
+        hoist(&node->lhs, info, edit);
+    }
+}
+
+static void hoist_list(Node **list, LoopInfo *info, LoopEdit *edit) {
+    for (Node **n = list; *n; n = &(*n)->next) {
+        hoist(n, info, edit);
+    }
+}
+
+static void hoist(Node **pnode, LoopInfo *info, LoopEdit *edit) {
+    Node *node = *pnode;
+    if (!node) {
+        return;
+    }
+
+    if (node->ty && is_invariant(info, node) && is_worth_hoisting(node)) {
+        Node *next = node->next;
+        node->next = NULL;
+
+        Node *repl;
+        if (is_const_expr(node) && eval(node) == (int)eval(node)) {
+            repl = new_num(eval(node), node->tok);
+            repl->ty = node->ty;
+        } else {
+            Obj *tmp = new_temp(edit, node->ty);
+            append(&edit->preheader, new_assign_stmt(tmp, node, node->tok));
+            repl = new_var_expr(tmp, node->tok);
+        }
+        repl->next = next;
+        *pnode = repl;
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_ASSIGN:
+        hoist_lvalue(node->lhs, info, edit);
+        hoist(&node->rhs, info, edit);
+        return;
+    case ND_ADDR:
+        hoist_lvalue(node->lhs, info, edit);
+        return;
+    }
+
+    hoist(&node->lhs, info, edit);
+    hoist(&node->rhs, info, edit);
+    hoist(&node->cond, info, edit);
+    hoist(&node->then, info, edit);
+    hoist(&node->els, info, edit);
+    hoist(&node->init, info, edit);
+    hoist(&node->update, info, edit);
+    hoist_list(&node->body, info, edit);
+    hoist_list(&node->args, info, edit);
+}
+
+//
+// Unrolling
+//
+
+static int count_nodes(Node *node) {
+    if (!node) {
+        return 0;
+    }
+
+    int n = 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+            count_nodes(node->cond) + count_nodes(node->then) +
+            count_nodes(node->els) + count_nodes(node->init) +
+            count_nodes(node->update);
+    for (Node *n2 = node->body; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    for (Node *n2 = node->args; n2; n2 = n2->next) {
+        n += count_nodes(n2);
+    }
+    return n;
+}
+
+// Deep copies a node, replacing reads of `var` with copies of `repl`.
+// The copies share variables and scopes with the original, which is fine
+// because they run one after another just like loop iterations do.
+static Node *clone_subst(Node *node, Obj *var, Node *repl) {
+    if (!node) {
+        return NULL;
+    }
+    if (node->kind == ND_VAR && node->var == var) {
+        return clone_subst(repl, NULL, NULL);
+    }
+
+    Node *copy = arena_calloc(1, sizeof(Node));
+    *copy = *node;
+    copy->next = NULL;
+    copy->lhs = clone_subst(node->lhs, var, repl);
+    copy->rhs = clone_subst(node->rhs, var, repl);
+    copy->cond = clone_subst(node->cond, var, repl);
+    copy->then = clone_subst(node->then, var, repl);
+    copy->els = clone_subst(node->els, var, repl);
+    copy->init = clone_subst(node->init, var, repl);
+    copy->update = clone_subst(node->update, var, repl);
+
+    Node head = {};
+    Node *cur = &head;
+    for (Node *n = node->body; n; n = n->next) {
+        cur = cur->next = clone_subst(n, var, repl);
+    }
+    copy->body = head.next;
+
+    head.next = NULL;
+    cur = &head;
+    for (Node *n = node->args; n; n = n->next) {
+        cur = cur->next = clone_subst(n, var, repl);
+    }
+    copy->args = head.next;
+    return copy;
+}
+
+static Node *new_int(long val, Type *ty, Token *tok) {
+    Node *node = new_num(val, tok);
+    node->ty = ty;
+    return node;
+}
+
+// Returns `var + offset`
+static Node *new_offset_expr(Obj *var, long offset, Token *tok) {
+    if (offset == 0) {
+        return new_var_expr(var, tok);
+    }
+    Node *node = new_binary(ND_ADD, new_var_expr(var, tok),
+                            new_int(offset, var->ty, tok), tok);
+    node->ty = var->ty;
+    return node;
+}
+
+// Returns the bound `n` of a loop condition `i < n` or `i <= n` if the
+// induction variable counts up, or `i > n` or `i >= n` if it counts down.
+// The bound must not change inside the loop.
+static Node *find_bound(Node *cond, InductionVar *iv, LoopInfo *info) {
+    if (!cond || (cond->kind != ND_LT && cond->kind != ND_LE)) {
+        return NULL;
+    }
+
+    Node *var = (iv->step > 0) ? cond->lhs : cond->rhs;
+    Node *bound = (iv->step > 0) ? cond->rhs : cond->lhs;
+    if (var->kind != ND_VAR || var->var != iv->var || !is_invariant(info, bound)) {
+        return NULL;
+    }
+    return bound;
+}
+
+// Computes the number of iterations of a loop that starts from and runs
+// up to constants.
+static bool get_trip_count(Node *node, InductionVar *iv, Node *bound,
+                           long *start, long *trips) {
+    Node *init = node->init;
+    if (!init || init->kind != ND_ASSIGN || init->lhs->kind != ND_VAR ||
+        init->lhs->var != iv->var || !is_const_expr(init->rhs) ||
+        !is_const_expr(bound)) {
+        return false;
+    }
+
+    *start = eval(init->rhs);
+    long end = eval(bound);
+    if (node->cond->kind == ND_LE) {
+        end += (iv->step > 0) ? 1 : -1;
+    }
+
+    long dist = (iv->step > 0) ? end - *start : *start - end;
+    long step = (iv->step > 0) ? iv->step : -iv->step;
+    *trips = (dist > 0) ? (dist + step - 1) / step : 0;
+
+    // All values of the induction variable must fit in a literal
+    long last = *start + *trips * iv->step;
+    return last == (int)last && *start == (int)*start;
+}
+
+// Replaces a loop with `trips` copies of its body, in which the induction
+// variable is replaced by its value in that iteration.
+//
+//   { body[i := start]; body[i := start + step]; ...; i = end; }
+static void unroll_fully(Node *node, InductionVar *iv, long start, long trips) {
+    Type *ty = iv->var->ty;
+    Node head = {};
+    Node *cur = &head;
+    for (long t = 0; t < trips; t++) {
+        Node *val = new_int(start + t * iv->step, ty, node->tok);
+        cur = cur->next = clone_subst(node->then, iv->var, val);
+    }
+    cur->next = new_assign_stmt(iv->var, new_int(start + trips * iv->step, ty, node->tok),
+                                node->tok);
+
+    Node *next = node->next;
+    Token *tok = node->tok;
+    *node = (Node){ND_BLOCK};
+    node->tok = tok;
+    node->body = head.next;
+    node->next = next;
+}
+
+// Rewrites a loop so that each iteration runs `factor` copies of the body
+//
+//   { init;
+//     for (; cond[i := i + (factor-1)*step]; i = i + factor*step)
+//       { body; body[i := i + step]; ...; body[i := i + (factor-1)*step] }
+//     for (; cond; update) body }
+//
+// The second loop runs the remaining iterations and is omitted if the
+// trip count is known to be a multiple of the factor.
+static void unroll_partially(Node *node, InductionVar *iv, int factor,
+                             bool need_remainder) {
+    Obj *var = iv->var;
+    Token *tok = node->tok;
+
+    Node *loop = new_node(ND_FOR_STMT, tok);
+    loop->cond = clone_subst(node->cond, var,
+                             new_offset_expr(var, (long)(factor - 1) * iv->step, tok));
+    loop->update = new_assign_stmt(var, new_offset_expr(var, (long)factor * iv->step, tok),
+                                   tok)->lhs;
+
+    Node head = {};
+    Node *cur = &head;
+    for (int j = 0; j < factor; j++) {
+        Node *body = clone_subst(node->then, var, new_offset_expr(var, (long)j * iv->step, tok));
+        cur = cur->next = body;
+    }
+    loop->then = new_node(ND_BLOCK, tok);
+    loop->then->body = head.next;
+
+    head.next = NULL;
+    cur = &head;
+    if (node->init) {
+        cur = cur->next = new_unary(ND_EXPR_STMT, node->init, tok);
+    }
+    cur = cur->next = loop;
+    if (need_remainder) {
+        Node *rem = arena_calloc(1, sizeof(Node));
+        *rem = *node;
+        rem->init = NULL;
+        rem->next = NULL;
+        cur = cur->next = rem;
+    }
+
+    Node *next = node->next;
+    *node = (Node){ND_BLOCK};
+    node->tok = tok;
+    node->body = head.next;
+    node->next = next;
+}
+
+// Returns true if the loop was replaced by straight-line code
+static bool unroll_loop(Node *node) {
+    LoopInfo info = {};
+    collect_info(node->cond, &info);
+    collect_info(node->then, &info);
+    collect_info(node->update, &info);
+
+    InductionVar iv;
+    Node *bound;
+    if (!find_induction_var(node->update, &info, &iv) || iv.step == 0 ||
+        !(bound = find_bound(node->cond, &iv, &info))) {
+        free(info.assigned);
+        return false;
+    }
+    free(info.assigned);
+
+    int size = count_nodes(node->then);
+    long start, trips;
+    bool known = get_trip_count(node, &iv, bound, &start, &trips);
+
+    if (known && trips * size <= opt_unroll_limit) {
+        unroll_fully(node, &iv, start, trips);
+        return true;
+    }
+
+    // A loop that never ran in the profile, or that ran only a few
+    // iterations each time it was entered, gains nothing from a larger
+    // body.
+    int factor = opt_unroll_factor;
+    long entries = profile_count(node->prof_id);
+    if (entries == 0) {
+        factor = 1;
+    } else if (entries > 0) {
+        long iters = profile_count(node->prof_id + 1);
+        while (factor > 1 && iters < entries * factor * 2) {
+            factor /= 2;
+        }
+    }
+    if (factor > 1 && size * factor <= MAX_UNROLLED_SIZE && !(known && trips < factor)) {
+        unroll_partially(node, &iv, factor, !known || trips % factor);
+    }
+    return false;
+}
+
+//
+// Vectorization
+//
+
+// An access to `base[i + offset]` in the body of a loop
+typedef struct {
+    Node *base;    // Invariant pointer
+    int offset;    // In elements
+    int stmt;      // Index of the statement containing the access
+    bool is_store;
+} MemRef;
+
+typedef struct {
+    InductionVar *iv;
+    LoopInfo *info;
+    Type *lane;    // Type of the array elements
+    MemRef refs[MAX_MEMREFS];
+    int nrefs;
+    int stmt;      // Index of the statement being vectorized
+    char *reason;  // Why the loop cannot be vectorized
+} VecInfo;
+
+static bool fail(VecInfo *vi, char *reason) {
+    if (!vi->reason) {
+        vi->reason = reason;
+    }
+    return false;
+}
+
+static bool has_loop(Node *node) {
+    if (!node) {
+        return false;
+    }
+    if (node->kind == ND_FOR_STMT || node->kind == ND_WHILE_STMT) {
+        return true;
+    }
+
+    if (has_loop(node->lhs) || has_loop(node->rhs) || has_loop(node->then) ||
+        has_loop(node->els)) {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next) {
+        if (has_loop(n)) {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        if (has_loop(n)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int count_uses(Node *node, Obj *var) {
+    if (!node) {
+        return 0;
+    }
+
+    int n = (node->kind == ND_VAR && node->var == var) +
+            count_uses(node->lhs, var) + count_uses(node->rhs, var) +
+            count_uses(node->cond, var) + count_uses(node->then, var) +
+            count_uses(node->els, var) + count_uses(node->init, var) +
+            count_uses(node->update, var);
+    for (Node *n2 = node->body; n2; n2 = n2->next) {
+        n += count_uses(n2, var);
+    }
+    for (Node *n2 = node->args; n2; n2 = n2->next) {
+        n += count_uses(n2, var);
+    }
+    return n;
+}
+
+// Matches the address `base + (i + offset) * size` of an array element
+// and records the access.
+static bool add_memref(VecInfo *vi, Node *addr, bool is_store) {
+    if (addr->kind != ND_ADD || !addr->ty->base || addr->rhs->kind != ND_MUL ||
+        addr->rhs->rhs->kind != ND_NUM) {
+        return fail(vi, "array index is not of the form i + constant");
+    }
+
+    Node *idx = addr->rhs->lhs;
+    int offset;
+    if (idx->kind == ND_VAR && idx->var == vi->iv->var) {
+        offset = 0;
+    } else if (idx->kind == ND_ADD && idx->lhs->kind == ND_VAR &&
+               idx->lhs->var == vi->iv->var && idx->rhs->kind == ND_NUM) {
+        offset = idx->rhs->val;
+    } else if (idx->kind == ND_SUB && idx->lhs->kind == ND_VAR &&
+               idx->lhs->var == vi->iv->var && idx->rhs->kind == ND_NUM) {
+        offset = -idx->rhs->val;
+    } else {
+        return fail(vi, "array index is not of the form i + constant");
+    }
+
+    if (!is_invariant(vi->info, addr->lhs)) {
+        return fail(vi, "array base may change inside the loop");
+    }
+    if (vi->nrefs == MAX_MEMREFS) {
+        return fail(vi, "too many memory accesses");
+    }
+    vi->refs[vi->nrefs++] = (MemRef){addr->lhs, offset, vi->stmt, is_store};
+    return true;
+}
+
+static Node *new_vec_node(NodeKind kind, Node *lhs, Node *rhs, VecInfo *vi) {
+    Node *node = new_binary(kind, lhs, rhs, lhs->tok);
+    node->ty = vi->lane;
+    return node;
+}
+
+// Returns the vector form of a scalar expression, or NULL. `exact` is set
+// if every lane holds the value of the scalar expression. Otherwise the
+// lanes hold it only modulo 256, which is enough for storing to a char.
+static Node *vectorize_expr(Node *node, VecInfo *vi, bool *exact, int depth) {
+    if (depth == MAX_VECTOR_DEPTH) {
+        fail(vi, "expression is too complex");
+        return NULL;
+    }
+    if (!node->ty || !is_integer(node->ty)) {
+        fail(vi, "non-integer expression");
+        return NULL;
+    }
+
+    if (is_invariant(vi->info, node)) {
+        *exact = vi->lane->size == 8 || node->ty->size == 1 ||
+                 (node->kind == ND_NUM && -128 <= node->val && node->val < 128);
+        return new_vec_node(ND_VSPLAT, clone_subst(node, NULL, NULL), NULL, vi);
+    }
+
+    switch (node->kind) {
+    case ND_DEREF:
+        if (node->ty->size != vi->lane->size) {
+            fail(vi, "mixed element sizes");
+            return NULL;
+        }
+        if (!add_memref(vi, node->lhs, false)) {
+            return NULL;
+        }
+        *exact = true;
+        return new_vec_node(ND_VLOAD, clone_subst(node->lhs, NULL, NULL), NULL, vi);
+    case ND_ADD:
+    case ND_SUB: {
+        bool e1, e2;
+        Node *lhs = vectorize_expr(node->lhs, vi, &e1, depth + 1);
+        Node *rhs = lhs ? vectorize_expr(node->rhs, vi, &e2, depth + 1) : NULL;
+        if (!rhs) {
+            return NULL;
+        }
+        *exact = vi->lane->size == 8;
+        return new_vec_node(node->kind == ND_ADD ? ND_VADD : ND_VSUB, lhs, rhs, vi);
+    }
+    case ND_EQ: {
+        // SSE2 can compare only bytes, words and dwords
+        if (vi->lane->size != 1) {
+            fail(vi, "comparison of 8-byte elements");
+            return NULL;
+        }
+        bool e1, e2;
+        Node *lhs = vectorize_expr(node->lhs, vi, &e1, depth + 1);
+        Node *rhs = lhs ? vectorize_expr(node->rhs, vi, &e2, depth + 1) : NULL;
+        if (!rhs) {
+            return NULL;
+        }
+        if (!e1 || !e2) {
+            fail(vi, "comparison of values wider than the elements");
+            return NULL;
+        }
+        *exact = true;
+        return new_vec_node(ND_VEQ, lhs, rhs, vi);
+    }
+    }
+
+    fail(vi, "unsupported operation");
+    return NULL;
+}
+
+// Finds the element type from the first array access in the body
+static Type *find_lane_type(Node *node) {
+    if (!node) {
+        return NULL;
+    }
+    if (node->kind == ND_DEREF && node->ty && is_integer(node->ty)) {
+        return node->ty;
+    }
+
+    Type *ty = find_lane_type(node->lhs);
+    if (!ty) {
+        ty = find_lane_type(node->rhs);
+    }
+    for (Node *n = node->body; n && !ty; n = n->next) {
+        ty = find_lane_type(n);
+    }
+    return ty;
+}
+
+// Vectorizes `a[i + k] = expr` or a reduction `s = s + expr`.
+static Node *vectorize_stmt(Node *node, Node *loop, VecInfo *vi) {
+    if (node->kind != ND_EXPR_STMT || node->lhs->kind != ND_ASSIGN) {
+        fail(vi, "statement is not an assignment");
+        return NULL;
+    }
+
+    Node *assign = node->lhs;
+    Node *lhs = assign->lhs;
+    Node *rhs = assign->rhs;
+    bool exact;
+
+    if (lhs->kind == ND_DEREF) {
+        if (lhs->ty->size != vi->lane->size || !is_integer(lhs->ty)) {
+            fail(vi, "mixed element sizes");
+            return NULL;
+        }
+        Node *val = vectorize_expr(rhs, vi, &exact, 0);
+        if (!val || !add_memref(vi, lhs->lhs, true)) {
+            return NULL;
+        }
+        Node *store = new_binary(ND_VSTORE, clone_subst(lhs->lhs, NULL, NULL), val, node->tok);
+        return new_unary(ND_EXPR_STMT, store, node->tok);
+    }
+
+    // The accumulator may be used only by the reduction itself
+    Obj *var = (lhs->kind == ND_VAR) ? lhs->var : NULL;
+    if (!var || !var->is_local || var->addr_taken || var->ty->kind != TY_INT ||
+        count_uses(loop, var) != 2) {
+        fail(vi, "assignment to a scalar that is not a sum reduction");
+        return NULL;
+    }
+
+    // s = s + e1 + ... + en  =>  s = s + sum(e1) + ... + sum(en)
+    Node *sum = new_var_expr(var, node->tok);
+    for (;;) {
+        if (rhs->kind != ND_ADD) {
+            fail(vi, "assignment to a scalar that is not a sum reduction");
+            return NULL;
+        }
+
+        Node *term;
+        Node *rest;
+        if (rhs->rhs->kind == ND_VAR && rhs->rhs->var == var) {
+            term = rhs->lhs;
+            rest = rhs->rhs;
+        } else {
+            term = rhs->rhs;
+            rest = rhs->lhs;
+        }
+
+        Node *val = vectorize_expr(term, vi, &exact, 0);
+        if (!val) {
+            return NULL;
+        }
+        if (!exact) {
+            fail(vi, "sum of values wider than the elements");
+            return NULL;
+        }
+
+        Node *vsum = new_unary(ND_VSUM, val, node->tok);
+        vsum->ty = ty_int;
+        sum = new_binary(ND_ADD, sum, vsum, node->tok);
+        sum->ty = var->ty;
+
+        if (rest->kind == ND_VAR && rest->var == var) {
+            return new_assign_stmt(var, sum, node->tok);
+        }
+        rhs = rest;
+    }
+}
+
+static bool is_array_var(Node *node) {
+    return node->kind == ND_VAR && node->var->ty->kind == TY_ARRAY;
+}
+
+// Returns `base + offset` in bytes
+static Node *new_ptr_offset(Node *base, int offset, Token *tok) {
+    Node *node = new_binary(ND_ADD, clone_subst(base, NULL, NULL),
+                            new_int(offset, ty_int, tok), tok);
+    node->ty = base->ty->base ? pointer_to(base->ty->base) : base->ty;
+    return node;
+}
+
+static Node *new_int_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+    Node *node = new_binary(kind, lhs, rhs, tok);
+    node->ty = ty_int;
+    return node;
+}
+
+// Returns a condition that is true at runtime if two accesses through
+// different pointers either hit the same elements or are at least a
+// vector apart, so that running them a vector at a time is safe.
+static Node *new_alias_check(MemRef *a, MemRef *b, int size, Token *tok) {
+    Node *p = new_ptr_offset(a->base, a->offset * size, tok);
+    Node *q = new_ptr_offset(b->base, b->offset * size, tok);
+    Node *p_end = new_ptr_offset(a->base, a->offset * size + VECTOR_SIZE, tok);
+    Node *q_end = new_ptr_offset(b->base, b->offset * size + VECTOR_SIZE, tok);
+
+    // p == q || p + 16 <= q || q + 16 <= p, where `+` of the results of
+    // comparisons serves as `||`.
+    Node *same = new_int_binary(ND_EQ, p, q, tok);
+    Node *before = new_int_binary(ND_LE, p_end, clone_subst(q, NULL, NULL), tok);
+    Node *after = new_int_binary(ND_LE, q_end, clone_subst(p, NULL, NULL), tok);
+    return new_int_binary(ND_ADD, same, new_int_binary(ND_ADD, before, after, tok), tok);
+}
+
+// Checks that running the statements a vector at a time reads and writes
+// the same values as running them an element at a time. Accesses through
+// pointers that may or may not alias are checked at runtime.
+static bool check_dependences(VecInfo *vi, Node **checks, Token *tok) {
+    int nchecks = 0;
+    for (int i = 0; i < vi->nrefs; i++) {
+        MemRef *st = &vi->refs[i];
+        if (!st->is_store) {
+            continue;
+        }
+
+        for (int j = 0; j < vi->nrefs; j++) {
+            MemRef *ref = &vi->refs[j];
+            if (i == j || (ref->is_store && j < i)) {
+                continue;
+            }
+
+            if (same_expr(st->base, ref->base)) {
+                // A load may see a store of the same iteration, or read
+                // ahead of stores of later statements, but never a value
+                // stored by a previous iteration.
+                if (ref->offset == st->offset) {
+                    continue;
+                }
+                if (!ref->is_store && ref->offset > st->offset && ref->stmt <= st->stmt) {
+                    continue;
+                }
+                return fail(vi, "loop-carried dependence");
+            }
+
+            if (is_array_var(st->base) && is_array_var(ref->base)) {
+                continue; // Distinct arrays never overlap
+            }
+
+            if (nchecks == MAX_ALIAS_CHECKS) {
+                return fail(vi, "too many pointers that may alias");
+            }
+            // `*` of the results of comparisons serves as `&&`
+            Node *check = new_alias_check(st, ref, vi->lane->size, tok);
+            *checks = *checks ? new_int_binary(ND_MUL, *checks, check, tok) : check;
+            nchecks++;
+        }
+    }
+    return true;
+}
+
+// Rewrites a loop as
+//
+//   { init;
+//     if (alias checks)
+//       for (; cond[i := i + lanes - 1]; i = i + lanes) vector-body;
+//     for (; cond; update) body }
+//
+// The second loop runs the remaining iterations. No alignment prologue is
+// needed because the vector loads and stores do not require alignment.
+static bool vectorize_loop(Node *node, char **reason) {
+    if (has_loop(node->then)) {
+        *reason = "not an innermost loop";
+        return false;
+    }
+
+    LoopInfo info = {};
+    collect_info(node->cond, &info);
+    collect_info(node->then, &info);
+    collect_info(node->update, &info);
+
+    InductionVar iv;
+    VecInfo vi = {};
+    vi.iv = &iv;
+    vi.info = &info;
+
+    if (!find_induction_var(node->update, &info, &iv) || iv.step != 1 ||
+        !find_bound(node->cond, &iv, &info)) {
+        fail(&vi, "no induction variable counting up by 1 to an invariant bound");
+    } else if (info.has_call) {
+        fail(&vi, "function call in the loop");
+    } else if (!(vi.lane = find_lane_type(node->then)) ||
+               (vi.lane->size != 1 && vi.lane->size != 8)) {
+        fail(&vi, "no array of chars or ints");
+    }
+
+    Node *stmts = (node->then->kind == ND_BLOCK) ? node->then->body : node->then;
+    if (node->then->kind == ND_BLOCK && node->then->scope &&
+        (node->then->scope->vars || node->then->scope->children)) {
+        fail(&vi, "local variables in the loop body");
+    }
+
+    Node head = {};
+    Node *cur = &head;
+    for (Node *n = stmts; n && !vi.reason; n = n->next) {
+        Node *v = vectorize_stmt(n, node, &vi);
+        if (v) {
+            cur = cur->next = v;
+        }
+        vi.stmt++;
+        if (node->then->kind != ND_BLOCK) {
+            break;
+        }
+    }
+
+    Node *checks = NULL;
+    if (!vi.reason && !head.next) {
+        fail(&vi, "empty loop body");
+    }
+    if (!vi.reason) {
+        check_dependences(&vi, &checks, node->tok);
+    }
+
+    long start, trips;
+    int lanes = vi.reason ? 0 : VECTOR_SIZE / vi.lane->size;
+    if (!vi.reason && get_trip_count(node, &iv, find_bound(node->cond, &iv, &info),
+                                     &start, &trips) && trips < lanes) {
+        fail(&vi, "too few iterations");
+    }
+    free(info.assigned);
+
+    if (vi.reason) {
+        *reason = vi.reason;
+        return false;
+    }
+
+    Token *tok = node->tok;
+    Node *loop = new_node(ND_FOR_STMT, tok);
+    loop->cond = clone_subst(node->cond, iv.var, new_offset_expr(iv.var, lanes - 1, tok));
+    loop->update = new_assign_stmt(iv.var, new_offset_expr(iv.var, lanes, tok), tok)->lhs;
+    loop->then = new_node(ND_BLOCK, tok);
+    loop->then->body = head.next;
+
+    Node *vec = loop;
+    if (checks) {
+        vec = new_node(ND_IF_STMT, tok);
+        vec->cond = checks;
+        vec->then = loop;
+    }
+
+    Node *rem = arena_calloc(1, sizeof(Node));
+    *rem = *node;
+    rem->init = NULL;
+    rem->next = NULL;
+    vec->next = rem;
+
+    Node *body = vec;
+    if (node->init) {
+        body = new_unary(ND_EXPR_STMT, node->init, tok);
+        body->next = vec;
+    }
+
+    Node *next = node->next;
+    *node = (Node){ND_BLOCK};
+    node->tok = tok;
+    node->body = body;
+    node->next = next;
+    return true;
+}
+
+// Rewrites `for (init; cond; update) body` as
+//
+//   { init; preheader; for (; cond; update) { body; latch } }
+static void optimize_loop(Node *node, Scope *sc) {
+    LoopInfo info = {};
+    collect_info(node->cond, &info);
+    collect_info(node->then, &info);
+    collect_info(node->update, &info);
+
+    LoopEdit edit = {};
+    edit.scope = sc;
+
+    if (opt_ivopts) {
+        reduce_strength(node, &info, &edit);
+    }
+    if (opt_licm) {
+        hoist(&node->cond, &info, &edit);
+        hoist(&node->then, &info, &edit);
+        hoist(&node->update, &info, &edit);
+    }
+    free(info.assigned);
+
+    if (edit.latch) {
+        Node *body = new_node(ND_BLOCK, node->then->tok);
+        body->body = node->then;
+        node->then->next = edit.latch;
+        node->then = body;
+    }
+
+    if (!edit.preheader) {
+        return;
+    }
+
+    Node *loop = arena_calloc(1, sizeof(Node));
+    *loop = *node;
+    loop->next = NULL;
+    loop->init = NULL;
+
+    Node head = {};
+    Node *cur = &head;
+    if (node->init) {
+        cur = cur->next = new_unary(ND_EXPR_STMT, node->init, node->tok);
+    }
+    cur->next = edit.preheader;
+    append(&head.next, loop);
+
+    Node *next = node->next;
+    *node = (Node){ND_BLOCK};
+    node->tok = loop->tok;
+    node->body = head.next;
+    node->next = next;
+}
+
+// Runs LICM and strength reduction on a loop, or on the loops that the
+// vectorizer or the unroller rewrote a loop to.
+static void optimize_loops_in(Node *node, Scope *sc) {
+    if (node->kind == ND_FOR_STMT) {
+        optimize_loop(node, sc);
+        return;
+    }
+
+    for (Node *n = node->body; n; n = n->next) {
+        if (n->kind == ND_FOR_STMT) {
+            optimize_loop(n, sc);
+        } else if (n->kind == ND_IF_STMT && n->then->kind == ND_FOR_STMT) {
+            optimize_loop(n->then, sc);
+        }
+    }
+}
+
+static void walk(Node *node, Scope *sc) {
+    if (!node) {
+        return;
+    }
+    if (node->scope) {
+        sc = node->scope;
+    }
+
+    walk(node->lhs, sc);
+    walk(node->rhs, sc);
+    walk(node->cond, sc);
+    walk(node->then, sc);
+    walk(node->els, sc);
+    walk(node->init, sc);
+    walk(node->update, sc);
+    for (Node *n = node->body; n; n = n->next) {
+        walk(n, sc);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        walk(n, sc);
+    }
+
+    // Inner loops are optimized before outer ones
+    if (node->kind != ND_FOR_STMT) {
+        return;
+    }
+
+    if (opt_vectorize) {
+        char *reason = NULL;
+        if (vectorize_loop(node, &reason)) {
+            if (opt_report) {
+                note_tok(node->tok, "loop vectorized");
+            }
+        } else if (opt_report && strcmp(reason, "not an innermost loop")) {
+            note_tok(node->tok, "loop not vectorized: %s", reason);
+        }
+    }
+    if (node->kind == ND_FOR_STMT && (opt_unroll_limit > 0 || opt_unroll_factor > 1) &&
+        unroll_loop(node)) {
+        return;
+    }
+    if (opt_licm || opt_ivopts) {
+        optimize_loops_in(node, sc);
+    }
+}
+
+void optimize_loops(Obj *prog) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function || fn->cached_asm) {
+            continue;
+        }
+        current_fn = fn;
+        walk(fn->body, fn->root_scope);
+    }
+}
@@ -1,13 +1,330 @@
 #include "ncc.h"
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        error("%s: invalid number of arguments\n", argv[0]);
+static char **input_paths;
+static int ninputs;
+static char **flags;
+static int nflags;
+static char *output_path;
+static int jobs = 1;
+static char *dump_profile_path;
+static char *server_path;
+static bool server_mode;
+static bool cache_stats;
+static bool watch_mode;
+
+// Units are handed out to the workers in order
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_input;
+static bool failed;
+
+static void usage(char *argv0) {
+    error("usage: %s [-O0] [-g] [-fno-omit-frame-pointer]\n"
+          "  [-fno-optimize-sibling-calls] [-finline-limit=N] [-fno-inline]\n"
+          "  [-fno-move-loop-invariants] [-fno-ivopts] [-funroll-factor=N]\n"
+          "  [-funroll-limit=N] [-fno-unroll-loops] [-fno-tree-vectorize]\n"
+          "  [-fopt-report] [-fno-cse] [-fwhole-program] [-fno-unit-at-a-time]\n"
+          "  [-fno-reorder-blocks] [-fno-reorder-blocks-and-partition]\n"
+          "  [-fprofile-generate[=FILE]] [-fprofile-use=FILE]\n"
+          "  [-finstrument-functions] [-pg] [-fno-peephole] [-fpeephole-stats]\n"
+          "  [-ftime-report] [-fstats=text|json]\n"
+          "  [-fcache-dir=DIR] [-fcache-max-size=MB] [-j N] [-o FILE]\n"
+          "  [--client SOCKET] <file>...\n"
+          "       %s --watch [options] [-o FILE] <file>\n"
+          "       %s --server SOCKET\n"
+          "       %s --cache-stats [-fcache-dir=DIR]\n"
+          "       %s --dump-profile FILE", argv0, argv0, argv0, argv0, argv0);
+}
+
+static void parse_args(int argc, char **argv) {
+    input_paths = calloc(argc, sizeof(char *));
+    flags = calloc(argc, sizeof(char *));
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc) {
+                usage(argv[0]);
+            }
+            output_path = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--watch")) {
+            watch_mode = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--cache-stats")) {
+            cache_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--server") || !strcmp(argv[i], "--client")) {
+            server_mode = !strcmp(argv[i], "--server");
+            if (++i == argc) {
+                usage(argv[0]);
+            }
+            server_path = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j")) {
+            if (++i == argc) {
+                usage(argv[0]);
+            }
+            jobs = atoi(argv[i]);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-j", 2)) {
+            jobs = atoi(argv[i] + 2);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--dump-profile")) {
+            if (++i == argc) {
+                usage(argv[0]);
+            }
+            dump_profile_path = argv[i];
+            continue;
+        }
+
+        if (set_option(argv[i])) {
+            flags[nflags++] = argv[i];
+            continue;
+        }
+
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            error("unknown argument: %s", argv[i]);
+        }
+
+        input_paths[ninputs++] = argv[i];
     }
 
-    Token *tok = tokenize_file(argv[1]);
-    Obj *prog = parse(tok);
-	codegen(prog);
+    finish_options();
+    if (!ninputs && !dump_profile_path && !server_mode && !cache_stats) {
+        usage(argv[0]);
+    }
+    if (jobs < 1) {
+        error("-j: the number of jobs must be positive");
+    }
+    if (watch_mode && (ninputs != 1 || !strcmp(input_paths[0], "-") || server_path)) {
+        error("--watch takes one file and cannot be used with a server");
+    }
+    if (ninputs > 1) {
+        if (output_path) {
+            error("cannot specify -o with multiple files");
+        }
+        for (int i = 0; i < ninputs; i++) {
+            if (!strcmp(input_paths[i], "-")) {
+                error("cannot read standard input with multiple files");
+            }
+        }
+    }
+}
+
+// Returns the output of one of several inputs, which is the input with
+// its extension replaced by .s
+static char *output_of(char *path) {
+    char *dot = strrchr(path, '.');
+    char *slash = strrchr(path, '/');
+    int len = (dot && (!slash || slash < dot)) ? dot - path : strlen(path);
+    return format("%.*s.s", len, path);
+}
+
+// Compiles one input. Its diagnostics are buffered and printed together,
+// so that the messages of concurrent compilations do not interleave.
+static bool compile_input(char *path) {
+    char *output = output_path;
+    if (ninputs > 1) {
+        output = output_of(path);
+    }
+
+    Context c = {};
+    c.filename = path;
+    c.flags = flags;
+    c.out = stdout;
+    if (output && strcmp(output, "-")) {
+        c.out = fopen(output, "w");
+        if (!c.out) {
+            pthread_mutex_lock(&lock);
+            fprintf(stderr, "cannot open %s: %s\n", output, strerror(errno));
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+    }
+
+    char *buf;
+    size_t buflen;
+    c.diag = open_memstream(&buf, &buflen);
+
+    bool ok = server_path ? compile_remote(&c, server_path) : compile(&c);
+    if (c.out == stdout) {
+        fflush(stdout);
+    } else {
+        fclose(c.out);
+        if (!ok) {
+            remove(output);
+        }
+    }
 
-    return 0;
+    fclose(c.diag);
+    pthread_mutex_lock(&lock);
+    fwrite(buf, 1, buflen, stderr);
+    pthread_mutex_unlock(&lock);
+    free(buf);
+    return ok;
+}
+
+static void *worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        int i = next_input++;
+        pthread_mutex_unlock(&lock);
+        if (i >= ninputs) {
+            return NULL;
+        }
+
+        if (!compile_input(input_paths[i])) {
+            pthread_mutex_lock(&lock);
+            failed = true;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+}
+
+// Writes the output of --watch. A new output replaces the old one at
+// once, so whatever reads it never sees a partial file.
+static bool write_output(char *path, char *buf, size_t len) {
+    if (!strcmp(path, "-")) {
+        fwrite(buf, 1, len, stdout);
+        return !fflush(stdout);
+    }
+
+    char *tmp = format("%s.tmp%d", path, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "cannot open %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(buf, 1, len, fp) == len;
+    ok = !fclose(fp) && ok;
+    if (!ok || rename(tmp, path)) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+// Compiles the watched file, reusing the functions that did not change
+// since the last compilation. The output is left alone on errors.
+static void rebuild(char *path, char *output, FunctionCache *cache) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Context c = {};
+    c.filename = path;
+    c.flags = flags;
+    c.fn_cache = cache;
+    c.diag = stderr;
+    char *buf;
+    size_t buflen;
+    c.out = open_memstream(&buf, &buflen);
+    bool ok = compile(&c);
+    fclose(c.out);
+
+    if (ok && write_output(output, buf, buflen)) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int reused, compiled;
+        function_cache_counts(cache, &reused, &compiled);
+        fprintf(stderr, "%s: %d of %d functions recompiled in %.1f ms\n", path, compiled,
+                reused + compiled,
+                (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    free(buf);
+}
+
+// Waits until the file named `name` in the watched directory is saved
+static void wait_for_save(int fd, char *name) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            error("inotify: %s", strerror(errno));
+        }
+
+        bool saved = false;
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, name)) {
+                saved = true;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if (saved) {
+            return;
+        }
+    }
+}
+
+// Recompiles a file every time it is saved, keeping the assembly of its
+// functions in memory from one compilation to the next
+static void watch(char *path) {
+    char *output = output_path ? output_path : output_of(path);
+    FunctionCache *cache = new_function_cache();
+
+    // Editors often save by renaming a new file over the old one, so
+    // watch the directory rather than the file
+    int fd = inotify_init1(IN_CLOEXEC);
+    char *dir = dirname(strdup(path));
+    char *name = basename(strdup(path));
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        error("cannot watch %s: %s", dir, strerror(errno));
+    }
+
+    for (;;) {
+        rebuild(path, output, cache);
+        wait_for_save(fd, name);
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (dump_profile_path) {
+        dump_profile(dump_profile_path);
+        return 0;
+    }
+    if (server_mode) {
+        serve(server_path);
+    }
+    if (cache_stats) {
+        print_cache_stats(stdout);
+        return 0;
+    }
+    if (watch_mode) {
+        watch(input_paths[0]);
+    }
+
+    if (jobs > ninputs) {
+        jobs = ninputs;
+    }
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL)) {
+            error("cannot create a thread");
+        }
+    }
+    worker(NULL);
+    for (int i = 1; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return failed;
 }
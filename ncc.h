@@ -2,14 +2,18 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct Type Type;
 
+#define unreachable() error("internal error at %s:%d", __FILE__, __LINE__)
+
 //
 // tokenize.c
 //
@@ -32,6 +36,7 @@ struct Token {
     int val;        // If kind is TK_NUM, its value
     char *loc;      // Token location
     int len;        // Token length
+    int line_no;    // Line number
     Type *ty;
     char *str;
 };
@@ -39,11 +44,14 @@ struct Token {
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
+void note_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *s);
 bool consume(Token **rest, Token *tok, char *str);
 Token *new_token(TokenKind kind, char *start, char *end);
-Token *tokenize_file(char *filename);
+char *read_input(void);
+Token *tokenize_input(char *p);
+Token *tokenize_next_decl(char **p);
 
 
 //
@@ -51,6 +59,7 @@ Token *tokenize_file(char *filename);
 //
 
 typedef struct Obj Obj;
+typedef struct Scope Scope;
 
 // AST node
 typedef enum {
@@ -72,10 +81,20 @@ typedef enum {
     ND_FOR_STMT,   // For statement
     ND_WHILE_STMT, // While statement
     ND_BLOCK,      // { ... }
+    ND_STMT_EXPR,  // Statement expression produced by the inliner
     ND_FUNCTION,   // Function declaration
     ND_FUNCALL,    // Function call
+    ND_EXPECT,     // __builtin_expect(lhs, val)
     ND_VAR,        // Variable
     ND_NUM,        // Integer
+    ND_VLOAD,      // Vector load from the address in lhs. Vectors are
+                   // 16 bytes of lanes of type `ty`.
+    ND_VSTORE,     // Vector store of rhs to the address in lhs
+    ND_VSPLAT,     // Scalar lhs copied to every lane
+    ND_VADD,       // Lane-wise '+'
+    ND_VSUB,       // Lane-wise '-'
+    ND_VEQ,        // Lane-wise '==', 1 or 0 in each lane
+    ND_VSUM,       // Sum of the lanes of lhs
 } NodeKind;
 
 // AST node type
@@ -90,6 +109,7 @@ struct Node {
     Node *rhs;      // Right-hand side
 
     Node *body;     // Collection of statement Node
+    Scope *scope;   // Used if kind == ND_BLOCK or ND_STMT_EXPR
 
     char *funcname; // Functaion call
     Node *args;
@@ -101,33 +121,76 @@ struct Node {
     Node *update;   // Used if "for"
 
     Obj *var;       // Used if kind == ND_VAR
-    int val;        // Used if kind == ND_NUM
+    int val;        // Used if kind == ND_NUM or ND_EXPECT
+
+    int prof_id;    // First profile counter of "if" or "for", or 0
 };
 
 // Local variable or global varable/function
+// Address of a global stored in the initial data of another
+typedef struct Relocation Relocation;
+struct Relocation {
+    Relocation *next;
+    int offset; // Offset of the address in the data
+    Obj *var;   // Global the address points into
+    long addend;
+};
+
 struct Obj {
     Obj *next;
     char *name;    // Variable name
     Type *ty;      // Variable type
     bool is_local; // local or global/function
 
+    // Local variable: its address is taken.
+    // Function: a pointer into its frame may be created.
+    bool addr_taken;
+
     // Local variable
     int offset;
+    Scope *scope;     // Block scope that declares the variable
+    Obj *scope_next;  // Next variable in the same block scope
 
     // Global variable
     bool is_function;
+    bool is_static; // Not visible outside the file
 
     // Global variable
     char *init_data;
+    Relocation *rel; // Addresses stored in init_data
+    bool is_literal; // String literal
+    bool is_const;   // Placed in read-only memory
 
     // Function
     Obj *params;
     Node *body;
     Obj *locals;
+    Scope *root_scope; // Outermost scope, which holds the parameters
     int stack_size;
+    bool omit_frame;   // Locals are addressed relative to %rsp
+    int prof_id;       // Profile counter of calls, or 0
+    Token *tok_begin;  // First token of the definition
+    Token *tok_end;    // Token after the definition
+    char *cached_asm;  // Assembly reused from an earlier compilation
+};
+
+// Block scope for local variables
+struct Scope {
+    Scope *parent;
+    Scope *children; // Nested block scopes
+    Scope *next;     // Next scope sharing the same parent
+    Obj *vars;       // Variables declared in this scope
 };
 
+Node *new_node(NodeKind kind, Token *tok);
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok);
+Node *new_unary(NodeKind kind, Node *expr, Token *tok);
+Node *new_var_node(Obj *var, Token *tok);
+Node *new_num(int val, Token *tok);
+Scope *new_scope(Scope *parent);
+Obj *add_lvar(Obj *fn, Scope *sc, char *name, Type *ty);
 Obj *parse(Token *tok);
+Obj *parse_toplevel(Token *tok);
 
 //
 // type.c
@@ -144,8 +207,10 @@ typedef enum {
 struct Type {
     TypeKind kind;
     int size;
+    int align;
     Type *base;
     Token *name;
+    bool is_const; // Qualified with const
     int array_len;
     Type *return_ty;
     Type *params;
@@ -167,7 +232,157 @@ void add_type(Node *node);
 // codegen.c
 //
 
-void codegen(Obj *prog);
+void codegen_begin(char *filename);
+void codegen_function(Obj *fn);
+void codegen_data(Obj *prog);
+void codegen(Obj *prog, char *filename);
+
+
+//
+// peephole.c
+//
+
+#define MAX_INST_ARGS 3
+
+typedef enum {
+    IN_OP,        // Machine instruction
+    IN_LABEL,     // Label
+    IN_DIRECTIVE, // Assembler directive such as .text
+    IN_DEBUG,     // .loc or .cfi_* directive, which the rules look through
+    IN_DELETED,   // Removed by the peephole optimizer
+} InstKind;
+
+// Structured assembly instruction
+typedef struct Inst Inst;
+struct Inst {
+    InstKind kind;
+    char *op;                  // Mnemonic, label name or directive text
+    char *args[MAX_INST_ARGS]; // Operands in AT&T order
+    int nargs;
+};
+
+// Peephole rewrite rule
+typedef struct {
+    char *name;
+    bool (*apply)(int i); // Tries to rewrite at the i-th instruction
+    int hits;             // Number of times the rule fired
+} PeepholeRule;
+
+void emit_line(char *line);
+void flush_insts(FILE *out);
+void print_peephole_stats(FILE *out);
+
+
+//
+// inline.c
+//
+
+void inline_functions(Obj *prog);
+
+
+//
+// hashmap.c
+//
+
+typedef struct {
+    char *key;
+    int keylen;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *buckets;
+    int capacity;
+    int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void hashmap_clear(HashMap *map);
+uint64_t fnv_hash(char *s, int len);
+
+
+//
+// loop.c
+//
+
+void optimize_loops(Obj *prog);
+
+
+//
+// cse.c
+//
+
+void eliminate_common_subexprs(Obj *prog);
+
+
+//
+// wholeprog.c
+//
+
+Obj *remove_unreachable(Obj *prog);
+
+
+//
+// profile.c
+//
+
+typedef struct {
+    char *fn;          // Function the counter belongs to
+    unsigned checksum; // Shape of the function
+    int index;         // Index within the function
+    long count;        // Value read from the profile, or -1
+} ProfileCounter;
+
+extern _Thread_local ProfileCounter *prof_counters;
+extern _Thread_local int nprof_counters;
+
+void assign_profile_counters(Obj *prog);
+void read_profile(char *path);
+void dump_profile(char *path);
+long profile_count(int id);
+bool profile_is_hot(int id);
+
+
+//
+// stats.c
+//
+
+typedef enum {
+    PH_READ,
+    PH_LEX,
+    PH_KEYWORDS,
+    PH_PARSE,
+    PH_TYPES,
+    PH_PROFILE,
+    PH_INLINE,
+    PH_LOOPS,
+    PH_CSE,
+    PH_WHOLE_PROGRAM,
+    PH_LAYOUT,
+    PH_EMIT,
+    PH_PEEPHOLE,
+    NUM_PHASES,
+} Phase;
+
+// Counters reported by -ftime-report and -fstats=json
+typedef struct {
+    long bytes;   // Bytes of source read
+    long lines;   // Lines of source read
+    long tokens;  // Tokens created
+    long nodes;   // AST nodes created by the parser
+    long types;   // Types created
+    long lookups; // Identifier lookups
+    long insts;   // Instructions emitted
+} Stats;
+
+extern _Thread_local Stats stats;
+
+void phase_begin(Phase phase);
+void phase_end(void);
+void print_stats(FILE *out);
 
 
 //
@@ -175,3 +390,132 @@ void codegen(Obj *prog);
 //
 
 char *format(char *fmt, ...);
+char *vformat(char *fmt, va_list ap);
+
+
+//
+// arena.c
+//
+
+void *arena_calloc(size_t n, size_t size);
+void *arena_realloc(void *ptr, size_t size);
+char *arena_strndup(char *s, size_t n);
+bool arena_use_scratch(bool on);
+void arena_free_scratch(void);
+void arena_release(void);
+
+
+//
+// compile.c
+//
+
+typedef struct FunctionCache FunctionCache;
+
+// State of the compilation of one translation unit
+typedef struct {
+    char *filename;    // Input filename
+    char *source;      // Source in memory, or NULL to read the file
+    size_t source_len;
+    char **flags;      // Options, terminated by NULL
+    FILE *out;         // Destination of the assembly
+    FILE *diag;        // Destination of diagnostics and reports
+
+    // Assembly of functions that may be reused from the previous
+    // compilation of the same file, or NULL
+    FunctionCache *fn_cache;
+
+    // Receives error messages instead of `diag` if set
+    void (*diagnostic)(const char *msg, void *arg);
+    void *diagnostic_arg;
+
+    char *input;       // Input string
+    jmp_buf *on_error; // Where errors unwind to
+
+    // Assembly captured to be stored in the cache. While it is
+    // generated, `out` is `cache_out`.
+    FILE *cache_out;
+    char *cache_buf;
+    size_t cache_len;
+
+    // parse.c
+    Obj *locals;       // Local variables of the current function
+    Obj *globals;      // Global variables and functions
+    Scope *scope;      // Innermost block scope
+    HashMap literals;  // String literals by contents
+
+    // codegen.c
+    int depth;         // Values pushed on the stack
+    int label_id;      // Counter for labels of the current function
+    int last_line;     // Last line number emitted with -g
+    bool in_cold_section;
+    Obj *current_fn;
+} Context;
+
+// Context of the compilation running on the current thread
+extern _Thread_local Context *ctx;
+
+bool compile(Context *c);
+
+
+//
+// incremental.c
+//
+
+FunctionCache *new_function_cache(void);
+void function_cache_counts(FunctionCache *cache, int *reused, int *compiled);
+void reuse_functions(Obj *prog);
+void reuse_function_asm(Obj *fn);
+void save_function_asm(Obj *fn);
+void commit_functions(void);
+
+
+//
+// cache.c
+//
+
+char *cache_key(char *input);
+bool cache_lookup(char *key);
+void cache_store(char *key, char *data, size_t len);
+void print_cache_stats(FILE *out);
+
+
+//
+// server.c
+//
+
+void serve(char *path);
+bool compile_remote(Context *c, char *path);
+
+
+//
+// options.c
+//
+
+extern _Thread_local bool opt_peephole;
+extern _Thread_local bool opt_omit_frame_pointer;
+extern _Thread_local bool opt_sibling_calls;
+extern _Thread_local int opt_inline_limit;
+extern _Thread_local bool opt_licm;
+extern _Thread_local bool opt_ivopts;
+extern _Thread_local int opt_unroll_factor;
+extern _Thread_local int opt_unroll_limit;
+extern _Thread_local bool opt_vectorize;
+extern _Thread_local bool opt_report;
+extern _Thread_local bool opt_cse;
+extern _Thread_local bool opt_whole_program;
+extern _Thread_local bool opt_unit_at_a_time;
+extern _Thread_local bool opt_reorder_blocks;
+extern _Thread_local bool opt_partition;
+extern _Thread_local char *opt_profile_generate;
+extern _Thread_local char *opt_profile_use;
+extern _Thread_local bool opt_instrument_functions;
+extern _Thread_local bool opt_pg;
+extern _Thread_local bool opt_debug_info;
+extern _Thread_local bool opt_time_report;
+extern _Thread_local bool opt_stats_json;
+extern _Thread_local bool opt_peephole_stats;
+extern _Thread_local char *opt_cache_dir;
+extern _Thread_local long opt_cache_max_size;
+
+bool set_option(char *arg);
+void finish_options(void);
@@ -0,0 +1,271 @@
+// Command-line options that control a compilation.
+//
+// The options are thread-local, since every compilation runs on a
+// thread of its own and applies its options there. A new thread starts
+// with the defaults below.
+#include "ncc.h"
+
+_Thread_local bool opt_peephole = true;
+_Thread_local bool opt_omit_frame_pointer = true;
+_Thread_local bool opt_sibling_calls = true;
+_Thread_local int opt_inline_limit = 40;
+_Thread_local bool opt_licm = true;
+_Thread_local bool opt_ivopts = true;
+_Thread_local int opt_unroll_factor = 4;
+_Thread_local int opt_unroll_limit = 64;
+_Thread_local bool opt_vectorize = true;
+_Thread_local bool opt_report;
+_Thread_local bool opt_cse = true;
+_Thread_local bool opt_whole_program;
+_Thread_local bool opt_unit_at_a_time = true;
+_Thread_local bool opt_reorder_blocks = true;
+_Thread_local bool opt_partition = true;
+_Thread_local char *opt_profile_generate;
+_Thread_local char *opt_profile_use;
+_Thread_local bool opt_instrument_functions;
+_Thread_local bool opt_pg;
+_Thread_local bool opt_debug_info;
+_Thread_local bool opt_time_report;
+_Thread_local bool opt_stats_json;
+_Thread_local bool opt_peephole_stats;
+_Thread_local char *opt_cache_dir;
+_Thread_local long opt_cache_max_size = 1L << 30;
+
+// Applies an option, and returns false if it is not one
+bool set_option(char *arg) {
+    if (!strncmp(arg, "-fcache-dir=", 12)) {
+        opt_cache_dir = arg + 12;
+        return true;
+    }
+
+    if (!strncmp(arg, "-fcache-max-size=", 17)) {
+        opt_cache_max_size = atol(arg + 17) << 20;
+        return true;
+    }
+
+    if (!strcmp(arg, "-O0")) {
+        opt_peephole = false;
+        opt_omit_frame_pointer = false;
+        opt_sibling_calls = false;
+        opt_inline_limit = 0;
+        opt_licm = false;
+        opt_ivopts = false;
+        opt_unroll_factor = 1;
+        opt_unroll_limit = 0;
+        opt_vectorize = false;
+        opt_cse = false;
+        opt_reorder_blocks = false;
+        opt_partition = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-ftime-report") || !strcmp(arg, "-fstats=text")) {
+        opt_time_report = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fstats=json")) {
+        opt_stats_json = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-g")) {
+        opt_debug_info = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-finstrument-functions")) {
+        opt_instrument_functions = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-pg")) {
+        opt_pg = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fprofile-generate")) {
+        opt_profile_generate = "ncc.prof";
+        return true;
+    }
+
+    if (!strncmp(arg, "-fprofile-generate=", 19)) {
+        opt_profile_generate = arg + 19;
+        return true;
+    }
+
+    if (!strncmp(arg, "-fprofile-use=", 14)) {
+        opt_profile_use = arg + 14;
+        return true;
+    }
+
+    if (!strcmp(arg, "-freorder-blocks")) {
+        opt_reorder_blocks = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-reorder-blocks")) {
+        opt_reorder_blocks = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-freorder-blocks-and-partition")) {
+        opt_partition = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-reorder-blocks-and-partition")) {
+        opt_partition = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-funit-at-a-time")) {
+        opt_unit_at_a_time = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-unit-at-a-time")) {
+        opt_unit_at_a_time = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fwhole-program")) {
+        opt_whole_program = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fcse")) {
+        opt_cse = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-cse")) {
+        opt_cse = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-ftree-vectorize")) {
+        opt_vectorize = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-tree-vectorize")) {
+        opt_vectorize = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fopt-report")) {
+        opt_report = true;
+        return true;
+    }
+
+    if (!strncmp(arg, "-funroll-factor=", 16)) {
+        opt_unroll_factor = atoi(arg + 16);
+        return true;
+    }
+
+    if (!strncmp(arg, "-funroll-limit=", 15)) {
+        opt_unroll_limit = atoi(arg + 15);
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-unroll-loops")) {
+        opt_unroll_factor = 1;
+        opt_unroll_limit = 0;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fmove-loop-invariants")) {
+        opt_licm = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-move-loop-invariants")) {
+        opt_licm = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fivopts")) {
+        opt_ivopts = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-ivopts")) {
+        opt_ivopts = false;
+        return true;
+    }
+
+    if (!strncmp(arg, "-finline-limit=", 15)) {
+        opt_inline_limit = atoi(arg + 15);
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-inline")) {
+        opt_inline_limit = 0;
+        return true;
+    }
+
+    if (!strcmp(arg, "-foptimize-sibling-calls")) {
+        opt_sibling_calls = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-optimize-sibling-calls")) {
+        opt_sibling_calls = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fomit-frame-pointer")) {
+        opt_omit_frame_pointer = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-omit-frame-pointer")) {
+        opt_omit_frame_pointer = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fpeephole")) {
+        opt_peephole = true;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fno-peephole")) {
+        opt_peephole = false;
+        return true;
+    }
+
+    if (!strcmp(arg, "-fpeephole-stats")) {
+        opt_peephole_stats = true;
+        return true;
+    }
+
+    return false;
+}
+
+// Resolves options that depend on each other, once all are set
+void finish_options(void) {
+    if (!opt_cache_dir) {
+        opt_cache_dir = getenv("NCC_CACHE_DIR");
+    }
+
+    // Counters are placed in the code as written, so transformations
+    // that duplicate loops or functions would make the counts
+    // incomplete.
+    if (opt_profile_generate) {
+        opt_inline_limit = 0;
+        opt_unroll_factor = 1;
+        opt_unroll_limit = 0;
+        opt_vectorize = false;
+    }
+
+    // Whole-program optimization and profiles need the whole unit.
+    // Otherwise, the bodies of callees are gone by the time they would
+    // be inlined.
+    if (opt_whole_program || opt_profile_generate || opt_profile_use) {
+        opt_unit_at_a_time = true;
+    }
+    if (!opt_unit_at_a_time) {
+        opt_inline_limit = 0;
+    }
+}
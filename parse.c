@@ -1,36 +1,52 @@
 #include "ncc.h"
 
-Obj *locals;
-Obj *globals;
+Scope *new_scope(Scope *parent) {
+    Scope *sc = arena_calloc(1, sizeof(Scope));
+    sc->parent = parent;
+    if (parent) {
+        sc->next = parent->children;
+        parent->children = sc;
+    }
+    return sc;
+}
+
+static void enter_scope(void) {
+    ctx->scope = new_scope(ctx->scope);
+}
+
+static void leave_scope(void) {
+    ctx->scope = ctx->scope->parent;
+}
 
-static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+Node *new_node(NodeKind kind, Token *tok) {
+    Node *node = arena_calloc(1, sizeof(Node));
+    stats.nodes++;
     node->tok  = tok;
     node->kind = kind;
     return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = lhs;
     node->rhs = rhs;
     return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
+Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = expr;
     return node;
 }
 
-static Node *new_var_node(Obj *var, Token *tok) {
+Node *new_var_node(Obj *var, Token *tok) {
     Node *node = new_node(ND_VAR, tok);
     node->var = var;
     return node;
 }
 
 static Obj *new_var(char *name, Type *ty) {
-    Obj *var = calloc(1, sizeof(Obj));
+    Obj *var = arena_calloc(1, sizeof(Obj));
     var->name = name;
     var->ty = ty;
     return var;
@@ -39,32 +55,51 @@ static Obj *new_var(char *name, Type *ty) {
 static Obj *new_lvar(char *name, Type *ty) {
     Obj *var = new_var(name, ty);
     var->is_local = true;
-    var->next = locals;
-    locals = var;
+    var->next = ctx->locals;
+    ctx->locals = var;
+    var->scope = ctx->scope;
+    var->scope_next = ctx->scope->vars;
+    ctx->scope->vars = var;
+    return var;
+}
+
+// Adds a local variable to a given scope of function `fn`. Used by
+// optimization passes that introduce variables after parsing.
+Obj *add_lvar(Obj *fn, Scope *sc, char *name, Type *ty) {
+    Obj *var = new_var(name, ty);
+    var->is_local = true;
+    var->next = fn->locals;
+    fn->locals = var;
+    var->scope = sc;
+    var->scope_next = sc->vars;
+    sc->vars = var;
     return var;
 }
 
 static Obj *new_gvar(char *name, Type *ty) {
     Obj *var = new_var(name, ty);
-    var->next = globals;
-    globals = var;
+    var->next = ctx->globals;
+    ctx->globals = var;
     return var;
 }
 
-static Node *new_num(int val, Token *tok) {
+Node *new_num(int val, Token *tok) {
     Node *node = new_node(ND_NUM, tok);
     node->val = val;
     return node;
 }
 
 Obj *find_var(Token *tok) {
-    for (Obj *var = locals; var; var = var->next) {
-        if (var->is_local && strlen(var->name) == tok->len && !strncmp(var->name, tok->loc, tok->len)) {
-            return var;
+    stats.lookups++;
+    for (Scope *sc = ctx->scope; sc; sc = sc->parent) {
+        for (Obj *var = sc->vars; var; var = var->scope_next) {
+            if (strlen(var->name) == tok->len && !strncmp(var->name, tok->loc, tok->len)) {
+                return var;
+            }
         }
     }
 
-    for (Obj *var = globals; var; var = var->next) {
+    for (Obj *var = ctx->globals; var; var = var->next) {
         if (strlen(var->name) == tok->len && !strncmp(var->name, tok->loc, tok->len)) {
             return var;
         }
@@ -196,18 +231,25 @@ static Node *while_stmt(Token **rest, Token *tok) {
     return node;
 }
 
-static char *new_unique_name(void) {
-    static int id = 0;
-    return format(".L..%d", id++);
-}
-
-static Obj *new_anon_gvar(Type *ty) {
-    return new_gvar(new_unique_name(), ty);
-}
-
+// A string literal is a global named after its contents, so that equal
+// literals share one and the assembly of a function does not depend on
+// the literals of the others. Two literals get the same name only if
+// their 64-bit hashes collide, which the assembler rejects.
 static Obj *new_string_literal(char *p, Type *ty) {
-    Obj *var = new_anon_gvar(ty);
-    var->init_data = p;
+    // Literals outlive the function that uses them, which is freed as
+    // soon as it is emitted with -fno-unit-at-a-time
+    bool scratch = arena_use_scratch(false);
+    Obj *var = hashmap_get2(&ctx->literals, p, ty->size);
+    if (!var) {
+        char *name = format(".L.str.%016lx", (unsigned long)fnv_hash(p, ty->size));
+        var = new_gvar(name, array_of(ty->base, ty->array_len));
+        var->is_static = true;
+        var->is_literal = true;
+        var->init_data = arena_calloc(1, ty->size);
+        memcpy(var->init_data, p, ty->size);
+        hashmap_put2(&ctx->literals, var->init_data, ty->size, var);
+    }
+    arena_use_scratch(scratch);
     return var;
 }
 
@@ -215,7 +257,7 @@ static char *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT) {
         error_tok(tok, "expected an identifier");
     }
-    return strndup(tok->loc, tok->len);
+    return arena_strndup(tok->loc, tok->len);
 }
 
 static int get_number(Token *tok) {
@@ -225,14 +267,31 @@ static int get_number(Token *tok) {
     return tok->val;
 }
 
-// declspec = "int"
+static bool is_typename(Token *tok) {
+    return equal(tok, "int") || equal(tok, "char") || equal(tok, "const");
+}
+
+static Type *qualify_const(Type *ty) {
+    ty = copy_type(ty);
+    ty->is_const = true;
+    return ty;
+}
+
+// declspec = "const"? ("int" | "char")
+//
+// A global variable whose own type is const goes to read-only memory.
+// Writes to const objects are not diagnosed.
 static Type *declspec(Token **rest, Token *tok) {
+    bool is_const = consume(&tok, tok, "const");
+    Type *ty = ty_int;
     if (equal(tok, "char")) {
-        *rest = tok->next;
-        return ty_char;
+        ty = ty_char;
+        tok = tok->next;
+    } else {
+        tok = skip(tok, "int");
     }
-    *rest = skip(tok, "int");
-    return ty_int;
+    *rest = tok;
+    return is_const ? qualify_const(ty) : ty;
 }
 
 // type-suffix = ("(" func-params? ")")?
@@ -271,16 +330,21 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
     return ty;
 }
 
-// declarator = "*"* ident type-suffix
+// declarator = ("*" "const"?)* ident type-suffix
 static Type *declarator(Token **rest, Token *tok, Type *ty) {
     while (consume(&tok, tok, "*")) {
         ty = pointer_to(ty);
+        if (consume(&tok, tok, "const")) {
+            ty->is_const = true;
+        }
     }
     if (tok->kind != TK_IDENT) {
         error_tok(tok, "expected a variable name");
     }
 
-    ty = type_suffix(rest, tok->next, ty);
+    // The type may be shared by other declarations, as ty_int is, so
+    // the name goes on a copy
+    ty = copy_type(type_suffix(rest, tok->next, ty));
     ty->name = tok;
     return ty;
 }
@@ -324,8 +388,11 @@ static Node *block(Token **rest, Token *tok) {
     Node head = {};
     Node *body = &head;
 
+    enter_scope();
+    node->scope = ctx->scope;
+
     while (!equal(tok, "}")) {
-        if (equal(tok, "int") || equal(tok, "char")) {
+        if (is_typename(tok)) {
             body = body->next = declaration(&tok, tok);
         } else {
             body = body->next = stmt(&tok, tok);
@@ -334,6 +401,7 @@ static Node *block(Token **rest, Token *tok) {
     }
     node->body = head.next;
     tok = skip(tok, "}");
+    leave_scope();
 
     *rest = tok;
     return node;
@@ -509,7 +577,11 @@ static Node *unary(Token **rest, Token *tok) {
         return new_unary(ND_NEG, unary(rest, tok->next), tok);
     }
     if (equal(tok, "&")) {
-        return new_unary(ND_ADDR, unary(rest, tok->next), tok);
+        Node *node = new_unary(ND_ADDR, unary(rest, tok->next), tok);
+        if (node->lhs->kind == ND_VAR) {
+            node->lhs->var->addr_taken = true;
+        }
+        return node;
     }
     if (equal(tok, "*")) {
         return new_unary(ND_DEREF, unary(rest, tok->next), tok);
@@ -532,6 +604,25 @@ static Node *postfix(Token **rest, Token *tok) {
     return node;
 }
 
+// __builtin_expect(expr, num) has the value of `expr` and tells the
+// code generator which value the program expects it to have.
+static Node *builtin_expect(Token **rest, Token *tok) {
+    Token *start = tok;
+    tok = skip(tok->next, "(");
+    Node *node = new_unary(ND_EXPECT, assign(&tok, tok), start);
+    tok = skip(tok, ",");
+    Node *expected = assign(&tok, tok);
+    if (expected->kind == ND_NEG && expected->lhs->kind == ND_NUM) {
+        node->val = -expected->lhs->val;
+    } else if (expected->kind == ND_NUM) {
+        node->val = expected->val;
+    } else {
+        error_tok(expected->tok, "expected a constant");
+    }
+    *rest = skip(tok, ")");
+    return node;
+}
+
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
     Token *start = tok;
@@ -550,7 +641,7 @@ static Node *funcall(Token **rest, Token *tok) {
     *rest = skip(tok, ")");
 
     Node *node = new_node(ND_FUNCALL, start);
-    node->funcname = strndup(start->loc, start->len);
+    node->funcname = arena_strndup(start->loc, start->len);
     node->args = head.next;
     return node;
 }
@@ -573,6 +664,9 @@ static Node *primary(Token **rest, Token *tok) {
     if (tok->kind == TK_IDENT) {
         // Function call
         if (equal(tok->next, "(")) {
+            if (equal(tok, "__builtin_expect")) {
+                return builtin_expect(rest, tok);
+            }
             return funcall(rest, tok);
         }
 
@@ -608,21 +702,154 @@ static void create_param_lvars(Type *param) {
     }
 }
 
-static Token *function(Token *tok, Type *ty) {
+static Obj *function(Token **rest, Token *tok, Type *ty, Token *start) {
     ty = declarator(&tok, tok, ty);
 
     Obj *fn = new_gvar(get_ident(ty->name), ty);
     fn->is_function = true;
+    fn->tok_begin = start;
 
-    locals = NULL;
+    ctx->locals = NULL;
+    enter_scope();
+    fn->root_scope = ctx->scope;
     create_param_lvars(ty->params);
-    fn->params = locals;
+    fn->params = ctx->locals;
 
     fn->body = block(&tok, tok);
-    fn->locals = locals;
-    return tok;
+    fn->locals = ctx->locals;
+    fn->tok_end = tok;
+    leave_scope();
+    *rest = tok;
+    return fn;
 }
 
+static long eval2(Node *node, Obj **var);
+
+static long eval(Node *node) {
+    return eval2(node, NULL);
+}
+
+// Evaluates the address of an lvalue
+static long eval_addr(Node *node, Obj **var) {
+    if (node->kind == ND_VAR && var && !node->var->is_local) {
+        *var = node->var;
+        return 0;
+    }
+    if (node->kind == ND_DEREF) {
+        return eval2(node->lhs, var);
+    }
+    error_tok(node->tok, "not a compile-time constant");
+}
+
+// Evaluates a constant expression. If `var` is not NULL, the expression
+// may also be the address of a global plus a constant, in which case the
+// global is stored in `*var` and the constant returned.
+static long eval2(Node *node, Obj **var) {
+    add_type(node);
+
+    switch (node->kind) {
+    case ND_ADD:
+        return eval2(node->lhs, var) + eval(node->rhs);
+    case ND_SUB:
+        return eval2(node->lhs, var) - eval(node->rhs);
+    case ND_MUL:
+        return eval(node->lhs) * eval(node->rhs);
+    case ND_DIV: {
+        long rhs = eval(node->rhs);
+        if (!rhs) {
+            error_tok(node->tok, "division by zero");
+        }
+        return eval(node->lhs) / rhs;
+    }
+    case ND_EQ:
+        return eval(node->lhs) == eval(node->rhs);
+    case ND_NE:
+        return eval(node->lhs) != eval(node->rhs);
+    case ND_LT:
+        return eval(node->lhs) < eval(node->rhs);
+    case ND_LE:
+        return eval(node->lhs) <= eval(node->rhs);
+    case ND_NEG:
+        return -eval(node->lhs);
+    case ND_NUM:
+        return node->val;
+    case ND_ADDR:
+        return eval_addr(node->lhs, var);
+    case ND_VAR:
+    case ND_DEREF:
+        // An array stands for the address of its first element
+        if (node->ty->kind == TY_ARRAY) {
+            return eval_addr(node, var);
+        }
+        break;
+    }
+    error_tok(node->tok, "not a compile-time constant");
+}
+
+// initializer = str | "{" (initializer ("," initializer)* ","?)? "}" | assign
+//
+// Evaluates the initializer of the part of type `ty` at `offset` in
+// global `var` into its data, and appends the addresses it holds to the
+// relocations after `cur`. Returns the last relocation.
+static Relocation *initializer(Token **rest, Token *tok, Relocation *cur, Obj *var,
+                               Type *ty, int offset) {
+    char *buf = var->init_data + offset;
+
+    if (ty->kind == TY_ARRAY && ty->base->kind == TY_CHAR && tok->kind == TK_STR) {
+        // The terminator is left out if the array has no room for it
+        int len = tok->ty->size < ty->size ? tok->ty->size : ty->size;
+        memcpy(buf, tok->str, len);
+        *rest = tok->next;
+        return cur;
+    }
+
+    if (ty->kind == TY_ARRAY) {
+        tok = skip(tok, "{");
+        for (int i = 0; !equal(tok, "}"); i++) {
+            if (i > 0) {
+                tok = skip(tok, ",");
+                if (equal(tok, "}")) {
+                    break;
+                }
+            }
+            if (i == ty->array_len) {
+                error_tok(tok, "too many initializers");
+            }
+            cur = initializer(&tok, tok, cur, var, ty->base, offset + ty->base->size * i);
+        }
+        *rest = skip(tok, "}");
+        return cur;
+    }
+
+    // The expression is not needed once it is evaluated
+    bool scratch = arena_use_scratch(true);
+    Node *node = assign(rest, tok);
+    Obj *target = NULL;
+    long val = eval2(node, ty->kind == TY_PTR ? &target : NULL);
+    arena_use_scratch(scratch);
+
+    if (target) {
+        Relocation *rel = arena_calloc(1, sizeof(Relocation));
+        rel->offset = offset;
+        rel->var = target;
+        rel->addend = val;
+        return cur->next = rel;
+    }
+    for (int i = 0; i < ty->size; i++) {
+        buf[i] = val >> (i * 8);
+    }
+    return cur;
+}
+
+// An array is read-only if its elements are
+static bool is_const_object(Type *ty) {
+    while (ty->kind == TY_ARRAY) {
+        ty = ty->base;
+    }
+    return ty->is_const;
+}
+
+// global-variable = declarator ("=" initializer)? ("," declarator ("=" initializer)?)* ";"
 static Token *global_variable(Token *tok, Type *basety) {
     bool first = true;
 
@@ -633,7 +860,15 @@ static Token *global_variable(Token *tok, Type *basety) {
         first = false;
 
         Type *ty = declarator(&tok, tok, basety);
-        new_gvar(get_ident(ty->name), ty);
+        Obj *var = new_gvar(get_ident(ty->name), ty);
+        var->is_const = is_const_object(ty);
+
+        if (consume(&tok, tok, "=")) {
+            var->init_data = arena_calloc(1, ty->size);
+            Relocation head = {};
+            initializer(&tok, tok, &head, var, ty, 0);
+            var->rel = head.next;
+        }
     }
 
     return tok;
@@ -649,19 +884,54 @@ static bool is_function(Token *tok) {
     return ty->kind == TY_FUNC;
 }
 
+// Parses the top-level declaration that `tok` holds, and returns the
+// function it defines, or NULL if it declares global variables. Global
+// variables are added to the globals from the arena of the compilation.
+// The function is left out of them, since it goes away with the scratch
+// arena it is parsed into once it is emitted.
+Obj *parse_toplevel(Token *tok) {
+    Token *start = tok;
+    Type *basety = declspec(&tok, tok);
+
+    if (!is_function(tok)) {
+        bool scratch = arena_use_scratch(false);
+        tok = global_variable(tok, basety);
+        arena_use_scratch(scratch);
+        if (tok->kind != TK_EOF) {
+            error_tok(tok, "expected a declaration");
+        }
+        return NULL;
+    }
+
+    Obj *fn = function(&tok, tok, basety, start);
+    if (tok->kind != TK_EOF) {
+        error_tok(tok, "expected a declaration");
+    }
+
+    // The function comes after the string literals it created
+    Obj **link = &ctx->globals;
+    while (*link != fn) {
+        link = &(*link)->next;
+    }
+    *link = fn->next;
+    fn->next = NULL;
+    return fn;
+}
+
 Obj *parse(Token *tok) {
-    globals = NULL;
+    ctx->globals = NULL;
 
     while (tok->kind != TK_EOF) {
+        Token *start = tok;
         Type *basety = declspec(&tok, tok);
 
         if (is_function(tok)) {
-            tok = function(tok, basety);
+            function(&tok, tok, basety, start);
             continue;
         }
 
         tok = global_variable(tok, basety);
     }
 
-    return globals;
+    return ctx->globals;
 }
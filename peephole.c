@@ -0,0 +1,544 @@
+#include "ncc.h"
+
+// Instructions of the function being generated. Code generator appends
+// to this buffer and `flush_insts` runs the peephole optimizer over it
+// before printing.
+static _Thread_local Inst *insts;
+static _Thread_local int ninsts;
+static _Thread_local int capacity;
+
+// Trims leading and trailing whitespace in place
+static char *trim(char *s) {
+    while (isspace(*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (s < end && isspace(end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+static Inst *new_inst(InstKind kind, char *op) {
+    if (ninsts == capacity) {
+        capacity = capacity ? capacity * 2 : 256;
+        insts = arena_realloc(insts, sizeof(Inst) * capacity);
+    }
+    Inst *inst = &insts[ninsts++];
+    *inst = (Inst){kind, op};
+    return inst;
+}
+
+// Records a line of assembly. Lines ending with ':' are labels, lines
+// starting with '.' are directives and everything else is an instruction
+// of the form "op arg, arg, ...".
+void emit_line(char *line) {
+    char *s = trim(line);
+    int len = strlen(s);
+
+    if (len == 0) {
+        return;
+    }
+
+    if (s[len - 1] == ':') {
+        s[len - 1] = '\0';
+        new_inst(IN_LABEL, s);
+        return;
+    }
+
+    if (!strncmp(s, ".loc ", 5) || !strncmp(s, ".cfi_", 5)) {
+        new_inst(IN_DEBUG, s);
+        return;
+    }
+
+    if (*s == '.') {
+        new_inst(IN_DIRECTIVE, s);
+        return;
+    }
+
+    char *p = s;
+    while (*p && !isspace(*p)) {
+        p++;
+    }
+    Inst *inst = new_inst(IN_OP, s);
+    if (!*p) {
+        return;
+    }
+    *p++ = '\0';
+
+    // Split operands at commas that are not inside parentheses
+    // such as "(%rax,%rdi,8)".
+    char *start = p;
+    int paren = 0;
+    for (;; p++) {
+        if (*p == '(') {
+            paren++;
+        } else if (*p == ')') {
+            paren--;
+        } else if ((*p == ',' && paren == 0) || *p == '\0') {
+            bool last = (*p == '\0');
+            *p = '\0';
+            if (inst->nargs == MAX_INST_ARGS) {
+                error("too many operands: %s", s);
+            }
+            inst->args[inst->nargs++] = trim(start);
+            if (last) {
+                return;
+            }
+            start = p + 1;
+        }
+    }
+}
+
+//
+// Peephole rules
+//
+
+static bool is_op(Inst *inst, char *op) {
+    return inst->kind == IN_OP && !strcmp(inst->op, op);
+}
+
+static bool is_jump(Inst *inst) {
+    return inst->kind == IN_OP && inst->op[0] == 'j';
+}
+
+static void delete_inst(Inst *inst) {
+    inst->kind = IN_DELETED;
+}
+
+// Returns the index of the next live instruction after `i`. Debug
+// information does not count, so that it does not change the code.
+static int next_live(int i) {
+    for (i++; i < ninsts; i++) {
+        if (insts[i].kind != IN_DELETED && insts[i].kind != IN_DEBUG) {
+            return i;
+        }
+    }
+    return ninsts;
+}
+
+static char *reg_aliases[][4] = {
+    {"%rax", "%eax", "%ax", "%al"},
+    {"%rdi", "%edi", "%di", "%dil"},
+    {"%rsi", "%esi", "%si", "%sil"},
+    {"%rdx", "%edx", "%dx", "%dl"},
+    {"%rcx", "%ecx", "%cx", "%cl"},
+    {"%r8", "%r8d", "%r8w", "%r8b"},
+    {"%r9", "%r9d", "%r9w", "%r9b"},
+    {"%rsp", "%esp", "%sp", "%spl"},
+};
+
+static bool arg_mentions(char *arg, char *reg) {
+    for (int i = 0; i < sizeof(reg_aliases) / sizeof(*reg_aliases); i++) {
+        if (strcmp(reg_aliases[i][0], reg)) {
+            continue;
+        }
+        for (int j = 0; j < 4; j++) {
+            char *p = arg;
+            int len = strlen(reg_aliases[i][j]);
+            while ((p = strstr(p, reg_aliases[i][j]))) {
+                // Do not confuse %r8 with %r8d and the like
+                if (!isalnum(p[len])) {
+                    return true;
+                }
+                p += len;
+            }
+        }
+        return false;
+    }
+    return strstr(arg, reg) != NULL;
+}
+
+// Returns true if `inst` may read or write `reg`, either explicitly or
+// implicitly.
+static bool mentions_reg(Inst *inst, char *reg) {
+    if (is_op(inst, "cqo") || is_op(inst, "idiv") || is_op(inst, "div") ||
+        is_op(inst, "mul") || (is_op(inst, "imul") && inst->nargs == 1)) {
+        if (!strcmp(reg, "%rax") || !strcmp(reg, "%rdx")) {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < inst->nargs; i++) {
+        if (arg_mentions(inst->args[i], reg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if `inst` writes `reg` without reading it and without
+// any other side effect.
+static bool is_pure_def(Inst *inst, char *reg) {
+    if (!is_op(inst, "mov") && !is_op(inst, "lea") && !is_op(inst, "movsbq") &&
+        !is_op(inst, "movzb")) {
+        return false;
+    }
+    return inst->nargs == 2 && !strcmp(inst->args[1], reg) &&
+           !arg_mentions(inst->args[0], reg);
+}
+
+// push %rax; <insts>; pop %reg  =>  mov %rax, %reg; <insts>
+//
+// Allowed only if the instructions in between neither touch the stack
+// nor %reg, and control cannot enter or leave the window.
+static bool push_pop(int i) {
+    Inst *push = &insts[i];
+    if (!is_op(push, "push") || strcmp(push->args[0], "%rax")) {
+        return false;
+    }
+
+    int j = next_live(i);
+    for (int n = 0; j < ninsts && n < 8; j = next_live(j), n++) {
+        Inst *inst = &insts[j];
+        if (inst->kind != IN_OP) {
+            return false;
+        }
+        if (is_op(inst, "pop")) {
+            char *reg = inst->args[0];
+            for (int k = next_live(i); k < j; k = next_live(k)) {
+                if (mentions_reg(&insts[k], reg)) {
+                    return false;
+                }
+            }
+            push->op = "mov";
+            push->args[1] = reg;
+            push->nargs = 2;
+            delete_inst(inst);
+            return true;
+        }
+        if (is_jump(inst) || is_op(inst, "push") || is_op(inst, "call") ||
+            is_op(inst, "ret") || mentions_reg(inst, "%rsp")) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// mov $0, %rax  =>  xor %eax, %eax
+// cmp $0, %rax  =>  test %rax, %rax
+static bool zero_idiom(int i) {
+    Inst *inst = &insts[i];
+    if (inst->nargs != 2 || strcmp(inst->args[0], "$0") ||
+        strcmp(inst->args[1], "%rax")) {
+        return false;
+    }
+
+    if (is_op(inst, "mov")) {
+        inst->op = "xor";
+        inst->args[0] = inst->args[1] = "%eax";
+        return true;
+    }
+    if (is_op(inst, "cmp")) {
+        inst->op = "test";
+        inst->args[0] = "%rax";
+        return true;
+    }
+    return false;
+}
+
+// add $0, %reg / sub $0, %reg  =>  (nothing)
+static bool nop_arith(int i) {
+    Inst *inst = &insts[i];
+    if ((is_op(inst, "add") || is_op(inst, "sub")) && inst->nargs == 2 &&
+        !strcmp(inst->args[0], "$0")) {
+        delete_inst(inst);
+        return true;
+    }
+    return false;
+}
+
+// A definition of %rax immediately overwritten by another one is dead.
+static bool dead_store(int i) {
+    Inst *inst = &insts[i];
+    bool is_zero = is_op(inst, "xor") && !strcmp(inst->args[0], "%eax") &&
+                   !strcmp(inst->args[1], "%eax");
+    if (!is_zero && !is_pure_def(inst, "%rax")) {
+        return false;
+    }
+
+    int j = next_live(i);
+    if (j < ninsts && is_pure_def(&insts[j], "%rax")) {
+        delete_inst(inst);
+        return true;
+    }
+    return false;
+}
+
+// lea X, %rax; mov (%rax), %rax  =>  mov X, %rax
+static bool fold_load(int i) {
+    Inst *lea = &insts[i];
+    if (!is_op(lea, "lea") || strcmp(lea->args[1], "%rax")) {
+        return false;
+    }
+
+    int j = next_live(i);
+    if (j == ninsts) {
+        return false;
+    }
+    Inst *load = &insts[j];
+    if ((!is_op(load, "mov") && !is_op(load, "movsbq")) || load->nargs != 2 ||
+        strcmp(load->args[0], "(%rax)") || strcmp(load->args[1], "%rax")) {
+        return false;
+    }
+
+    load->args[0] = lea->args[0];
+    delete_inst(lea);
+    return true;
+}
+
+// Returns true if label `name` appears in the run of labels following `i`.
+static bool is_next_label(int i, char *name) {
+    for (int j = next_live(i); j < ninsts && insts[j].kind == IN_LABEL;
+         j = next_live(j)) {
+        if (!strcmp(insts[j].op, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// jmp .L.x; .L.x:  =>  .L.x:
+static bool jump_to_next(int i) {
+    Inst *inst = &insts[i];
+    if (!is_jump(inst) || !is_next_label(i, inst->args[0])) {
+        return false;
+    }
+    delete_inst(inst);
+    return true;
+}
+
+// Map from label names to their instructions. Labels are never added
+// or removed by the rules, so the map is built once per flush.
+static _Thread_local HashMap labels;
+
+static void build_label_map(void) {
+    hashmap_clear(&labels);
+    for (int i = 0; i < ninsts; i++) {
+        if (insts[i].kind == IN_LABEL) {
+            hashmap_put(&labels, insts[i].op, &insts[i]);
+        }
+    }
+}
+
+// Returns the index of the label `name`, or -1.
+static int find_label(char *name) {
+    Inst *inst = hashmap_get(&labels, name);
+    return inst ? inst - insts : -1;
+}
+
+// jmp .L.a; ... .L.a: jmp .L.b  =>  jmp .L.b; ... .L.a: jmp .L.b
+static bool jump_thread(int i) {
+    Inst *inst = &insts[i];
+    if (!is_jump(inst)) {
+        return false;
+    }
+
+    int j = find_label(inst->args[0]);
+    if (j < 0) {
+        return false;
+    }
+    while (j < ninsts && insts[j].kind == IN_LABEL) {
+        j = next_live(j);
+    }
+    if (j == ninsts || j == i || !is_op(&insts[j], "jmp") ||
+        !strcmp(insts[j].args[0], inst->args[0])) {
+        return false;
+    }
+    inst->args[0] = insts[j].args[0];
+    return true;
+}
+
+// Instructions after an unconditional jump up to the next label or
+// directive are never executed.
+static bool unreachable_code(int i) {
+    Inst *inst = &insts[i];
+    if (!is_op(inst, "jmp") && !is_op(inst, "ret")) {
+        return false;
+    }
+
+    bool changed = false;
+    for (int j = next_live(i); j < ninsts && insts[j].kind == IN_OP;
+         j = next_live(j)) {
+        delete_inst(&insts[j]);
+        changed = true;
+    }
+    return changed;
+}
+
+static _Thread_local PeepholeRule rules[] = {
+    {"push-pop-to-mov", push_pop},
+    {"zero-idiom", zero_idiom},
+    {"nop-arith", nop_arith},
+    {"dead-store", dead_store},
+    {"fold-load", fold_load},
+    {"jump-to-next", jump_to_next},
+    {"jump-thread", jump_thread},
+    {"unreachable", unreachable_code},
+};
+
+// Applies the rules until no rule matches anymore.
+static void peephole(void) {
+    build_label_map();
+    for (int iter = 0; iter < 16; iter++) {
+        bool changed = false;
+        for (int i = 0; i < ninsts; i++) {
+            for (int r = 0; r < sizeof(rules) / sizeof(*rules); r++) {
+                if (insts[i].kind == IN_DELETED) {
+                    break;
+                }
+                if (rules[r].apply(i)) {
+                    rules[r].hits++;
+                    changed = true;
+                }
+            }
+        }
+        if (!changed) {
+            return;
+        }
+    }
+}
+
+//
+// Call frame information
+//
+// Offsets of the canonical frame address from %rsp change with every
+// push and pop of a temporary, and the rules remove many of them. The
+// code generator describes only how the frame is set up and torn down,
+// and the directives for the other changes of %rsp are added as the
+// final code is printed.
+//
+
+#define MAX_CFA_STATES 8
+
+typedef struct {
+    bool in_proc;   // Between .cfi_startproc and .cfi_endproc
+    bool rbp_based; // The CFA is %rbp+16 rather than %rsp-relative
+    int offset;     // CFA minus %rsp, if not rbp_based
+} CfaState;
+
+static _Thread_local CfaState cfa;
+static _Thread_local CfaState saved_cfa[MAX_CFA_STATES];
+static _Thread_local int nsaved_cfa;
+
+// Returns the change in the stack size made by an instruction
+static int stack_change(Inst *inst) {
+    if (is_op(inst, "push")) {
+        return 8;
+    }
+    if (is_op(inst, "pop")) {
+        return -8;
+    }
+    if ((is_op(inst, "sub") || is_op(inst, "add")) && inst->nargs == 2 &&
+        !strcmp(inst->args[1], "%rsp") && inst->args[0][0] == '$') {
+        int n = atoi(inst->args[0] + 1);
+        return is_op(inst, "sub") ? n : -n;
+    }
+    return 0;
+}
+
+// Prints directives to go before an instruction
+static void cfi_before(FILE *out, Inst *inst) {
+    if (!cfa.in_proc) {
+        return;
+    }
+
+    // Code moved to another section is a fragment with a frame
+    // description of its own.
+    if (inst->kind == IN_DIRECTIVE && !strncmp(inst->op, ".popsection", 11)) {
+        fprintf(out, "  .cfi_endproc\n");
+    }
+}
+
+// Updates the tracked state and prints directives to go after an
+// instruction
+static void cfi_after(FILE *out, Inst *inst) {
+    if (inst->kind == IN_DEBUG) {
+        if (!strcmp(inst->op, ".cfi_startproc")) {
+            cfa = (CfaState){true, false, 8};
+            nsaved_cfa = 0;
+        } else if (!strcmp(inst->op, ".cfi_endproc")) {
+            cfa.in_proc = false;
+        } else if (!strcmp(inst->op, ".cfi_def_cfa_register %rbp")) {
+            cfa.rbp_based = true;
+        } else if (!strncmp(inst->op, ".cfi_def_cfa %rsp,", 18)) {
+            cfa.rbp_based = false;
+            cfa.offset = atoi(inst->op + 18);
+        } else if (!strcmp(inst->op, ".cfi_remember_state")) {
+            if (nsaved_cfa == MAX_CFA_STATES) {
+                error("too many saved call frame states");
+            }
+            saved_cfa[nsaved_cfa++] = cfa;
+        } else if (!strcmp(inst->op, ".cfi_restore_state")) {
+            cfa = saved_cfa[--nsaved_cfa];
+        }
+        return;
+    }
+
+    if (!cfa.in_proc) {
+        return;
+    }
+
+    if (inst->kind == IN_DIRECTIVE && !strncmp(inst->op, ".pushsection", 12)) {
+        fprintf(out, "  .cfi_startproc\n");
+        if (cfa.rbp_based) {
+            fprintf(out, "  .cfi_def_cfa %%rbp, 16\n");
+            fprintf(out, "  .cfi_offset %%rbp, -16\n");
+        } else if (cfa.offset != 8) {
+            fprintf(out, "  .cfi_def_cfa_offset %d\n", cfa.offset);
+        }
+        return;
+    }
+
+    int n = stack_change(inst);
+    if (n && !cfa.rbp_based) {
+        cfa.offset += n;
+        fprintf(out, "  .cfi_adjust_cfa_offset %d\n", n);
+    }
+}
+
+static void print_inst(FILE *out, Inst *inst) {
+    switch (inst->kind) {
+    case IN_LABEL:
+        fprintf(out, "%s:\n", inst->op);
+        return;
+    case IN_DIRECTIVE:
+    case IN_DEBUG:
+        fprintf(out, "  %s\n", inst->op);
+        return;
+    case IN_OP:
+        fprintf(out, "  %s", inst->op);
+        for (int i = 0; i < inst->nargs; i++) {
+            fprintf(out, "%s%s", i ? ", " : " ", inst->args[i]);
+        }
+        fprintf(out, "\n");
+        return;
+    }
+}
+
+// Optimizes and prints buffered instructions, then empties the buffer.
+void flush_insts(FILE *out) {
+    if (opt_peephole) {
+        phase_begin(PH_PEEPHOLE);
+        peephole();
+        phase_end();
+    }
+    for (int i = 0; i < ninsts; i++) {
+        if (insts[i].kind == IN_OP) {
+            stats.insts++;
+        }
+        if (insts[i].kind != IN_DELETED) {
+            cfi_before(out, &insts[i]);
+            print_inst(out, &insts[i]);
+            cfi_after(out, &insts[i]);
+        }
+    }
+    ninsts = 0;
+}
+
+void print_peephole_stats(FILE *out) {
+    for (int r = 0; r < sizeof(rules) / sizeof(*rules); r++) {
+        fprintf(out, "peephole: %-16s %d\n", rules[r].name, rules[r].hits);
+    }
+}
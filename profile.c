@@ -0,0 +1,216 @@
+// Profile-guided optimization.
+//
+// Every function, if statement and for statement of the source gets
+// counters before any optimization changes the code. A function has one
+// counter for the number of calls. An if statement has two, for the
+// number of times its condition is evaluated and the number of times
+// the then branch runs. A for statement has two as well, for the number
+// of times the loop is entered and the number of iterations.
+//
+// With -fprofile-generate, the program increments the counters as it
+// runs and appends them to a profile when it exits. The profile is a
+// text file with a line
+//
+//   <function> <checksum> <index> <count>
+//
+// per counter. Lines for the same counter are summed when the profile
+// is read, so profiles of several runs are merged by concatenating them.
+// The checksum describes the statements of the function, so that counts
+// of a function that has changed since the profile was taken are
+// ignored.
+//
+// With -fprofile-use, the counts are read back into the counters for the
+// optimizer and code generator to consult.
+#include "ncc.h"
+
+// A function is hot if it is called at least this fraction of the
+// number of times the most frequently called function is.
+#define HOT_FRACTION 100
+
+_Thread_local ProfileCounter *prof_counters;
+_Thread_local int nprof_counters;
+static _Thread_local int capacity;
+
+static _Thread_local long max_calls;
+
+// A counter read from a profile
+typedef struct {
+    char *fn;
+    unsigned checksum;
+    int index;
+    long count;
+} Record;
+
+static _Thread_local Record *records;
+static _Thread_local int nrecords;
+static _Thread_local int records_capacity;
+
+// Function whose counters are being assigned
+static _Thread_local Obj *current_fn;
+static _Thread_local int fn_start;
+static _Thread_local unsigned fn_checksum;
+
+static int new_counters(int n) {
+    int id = nprof_counters + 1;
+    for (int i = 0; i < n; i++) {
+        if (nprof_counters == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            prof_counters = arena_realloc(prof_counters, sizeof(ProfileCounter) * capacity);
+        }
+        int index = nprof_counters - fn_start;
+        prof_counters[nprof_counters++] = (ProfileCounter){current_fn->name, 0, index, -1};
+    }
+    return id;
+}
+
+static void assign(Node *node) {
+    if (!node) {
+        return;
+    }
+    if (node->kind == ND_IF_STMT || node->kind == ND_FOR_STMT) {
+        node->prof_id = new_counters(2);
+        fn_checksum = (fn_checksum ^ node->kind) * 16777619;
+    }
+
+    assign(node->lhs);
+    assign(node->rhs);
+    assign(node->cond);
+    assign(node->then);
+    assign(node->els);
+    assign(node->init);
+    assign(node->update);
+    for (Node *n = node->body; n; n = n->next) {
+        assign(n);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        assign(n);
+    }
+}
+
+void assign_profile_counters(Obj *prog) {
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function) {
+            continue;
+        }
+
+        current_fn = fn;
+        fn_start = nprof_counters;
+        fn_checksum = 2166136261;
+        fn->prof_id = new_counters(1);
+        assign(fn->body);
+        for (int i = fn_start; i < nprof_counters; i++) {
+            prof_counters[i].checksum = fn_checksum;
+        }
+    }
+}
+
+static char *record_key(char *fn, unsigned checksum, int index) {
+    return format("%s %u %d", fn, checksum, index);
+}
+
+// Reads a profile, summing the counts of the same counter
+static void load_profile(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+
+    HashMap map = {};
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline(&line, &len, fp) != -1) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        char *fn = line;
+        char *p = strchr(line, ' ');
+        unsigned checksum;
+        int index;
+        long count;
+        if (!p || sscanf(p, "%u %d %ld", &checksum, &index, &count) != 3) {
+            error("%s:%d: malformed profile", path, lineno);
+        }
+        *p = '\0';
+
+        // The map holds indices, since the array may move
+        char *key = record_key(fn, checksum, index);
+        int i = (intptr_t)hashmap_get(&map, key);
+        if (i) {
+            records[i - 1].count += count;
+            continue;
+        }
+
+        if (nrecords == records_capacity) {
+            records_capacity = records_capacity ? records_capacity * 2 : 64;
+            records = arena_realloc(records, sizeof(Record) * records_capacity);
+        }
+        records[nrecords] = (Record){arena_strndup(fn, strlen(fn)), checksum, index, count};
+        hashmap_put(&map, key, (void *)(intptr_t)(nrecords + 1));
+        nrecords++;
+    }
+    free(line);
+    fclose(fp);
+}
+
+void read_profile(char *path) {
+    load_profile(path);
+
+    HashMap map = {};
+    for (int i = 0; i < nrecords; i++) {
+        Record *rec = &records[i];
+        hashmap_put(&map, record_key(rec->fn, rec->checksum, rec->index), rec);
+    }
+
+    for (int i = 0; i < nprof_counters; i++) {
+        ProfileCounter *c = &prof_counters[i];
+        Record *rec = hashmap_get(&map, record_key(c->fn, c->checksum, c->index));
+        if (rec) {
+            c->count = rec->count;
+            if (c->index == 0 && c->count > max_calls) {
+                max_calls = c->count;
+            }
+        }
+    }
+}
+
+static int cmp_record(const void *a, const void *b) {
+    const Record *x = a;
+    const Record *y = b;
+    int cmp = strcmp(x->fn, y->fn);
+    if (cmp) {
+        return cmp;
+    }
+    if (x->checksum != y->checksum) {
+        return x->checksum < y->checksum ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+// Prints a profile with the runs in it merged, which is itself a valid
+// profile.
+void dump_profile(char *path) {
+    load_profile(path);
+    qsort(records, nrecords, sizeof(Record), cmp_record);
+    printf("# ncc profile\n");
+    for (int i = 0; i < nrecords; i++) {
+        Record *rec = &records[i];
+        printf("%s %u %d %ld\n", rec->fn, rec->checksum, rec->index, rec->count);
+    }
+}
+
+// Returns the value of a counter, or -1 if it is not known
+long profile_count(int id) {
+    if (id == 0) {
+        return -1;
+    }
+    return prof_counters[id - 1].count;
+}
+
+// Returns true if the profile shows that a function is called often
+bool profile_is_hot(int id) {
+    long count = profile_count(id);
+    return count > 0 && count * HOT_FRACTION >= max_calls;
+}
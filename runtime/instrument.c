@@ -0,0 +1,152 @@
+// Runtime for programs compiled with -finstrument-functions.
+//
+// Every instrumented function calls __cyg_profile_func_enter on entry
+// and __cyg_profile_func_exit before it returns. This runtime counts the
+// calls of each function and the time spent in it, including its
+// callees, in time-stamp counter ticks, and prints a report when the
+// program exits. The report goes to stderr, or to the file named by
+// NCC_INSTRUMENT_REPORT.
+//
+// Functions are identified by the symbol dladdr finds for them, which
+// requires linking with -rdynamic, or else by their offset in the
+// executable, which addr2line can resolve. The runtime is not
+// thread-safe.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+// Number of distinct functions that can be tracked, a power of two
+#define MAX_FUNCS 4096
+
+// Deepest call chain that is timed
+#define MAX_DEPTH 4096
+
+typedef struct {
+    void *fn;
+    uint64_t calls;
+    uint64_t ticks;  // Inclusive time of outermost activations
+    int active;      // Activations on the call stack
+} FuncStats;
+
+typedef struct {
+    FuncStats *stats;
+    uint64_t start;
+} Frame;
+
+static FuncStats funcs[MAX_FUNCS];
+static int nfuncs;
+
+static Frame stack[MAX_DEPTH];
+static int depth;
+
+// Calls deeper than MAX_DEPTH or beyond MAX_FUNCS are not recorded
+static uint64_t dropped;
+
+NO_INSTRUMENT
+static FuncStats *lookup(void *fn) {
+    uintptr_t h = ((uintptr_t)fn >> 4) & (MAX_FUNCS - 1);
+    for (int i = 0; i < MAX_FUNCS; i++) {
+        FuncStats *f = &funcs[(h + i) & (MAX_FUNCS - 1)];
+        if (f->fn == fn) {
+            return f;
+        }
+        if (!f->fn) {
+            // Leave one slot empty so that lookups terminate
+            if (nfuncs == MAX_FUNCS - 1) {
+                return NULL;
+            }
+            nfuncs++;
+            f->fn = fn;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+NO_INSTRUMENT
+void __cyg_profile_func_enter(void *fn, void *call_site) {
+    FuncStats *f = (depth < MAX_DEPTH) ? lookup(fn) : NULL;
+    if (f) {
+        f->calls++;
+        f->active++;
+    } else {
+        dropped++;
+    }
+    if (depth < MAX_DEPTH) {
+        stack[depth] = (Frame){f, __rdtsc()};
+    }
+    depth++;
+}
+
+NO_INSTRUMENT
+void __cyg_profile_func_exit(void *fn, void *call_site) {
+    if (depth == 0) {
+        return;
+    }
+    depth--;
+    if (depth >= MAX_DEPTH || !stack[depth].stats) {
+        return;
+    }
+
+    // A recursive call is already covered by its outermost activation
+    Frame *frame = &stack[depth];
+    if (--frame->stats->active == 0) {
+        frame->stats->ticks += __rdtsc() - frame->start;
+    }
+}
+
+NO_INSTRUMENT
+static int cmp_ticks(const void *a, const void *b) {
+    const FuncStats *x = a;
+    const FuncStats *y = b;
+    if (x->ticks != y->ticks) {
+        return x->ticks < y->ticks ? 1 : -1;
+    }
+    return x->calls < y->calls ? 1 : (x->calls > y->calls ? -1 : 0);
+}
+
+NO_INSTRUMENT
+__attribute__((destructor))
+static void report(void) {
+    FILE *out = stderr;
+    char *path = getenv("NCC_INSTRUMENT_REPORT");
+    if (path && !(out = fopen(path, "w"))) {
+        perror(path);
+        return;
+    }
+
+    FuncStats *sorted = malloc(sizeof(FuncStats) * (nfuncs ? nfuncs : 1));
+    int n = 0;
+    for (int i = 0; i < MAX_FUNCS; i++) {
+        if (funcs[i].fn) {
+            sorted[n++] = funcs[i];
+        }
+    }
+    qsort(sorted, n, sizeof(FuncStats), cmp_ticks);
+
+    fprintf(out, "%12s %16s  %s\n", "calls", "inclusive ticks", "function");
+    for (int i = 0; i < n; i++) {
+        Dl_info info = {0};
+        fprintf(out, "%12lu %16lu  ", sorted[i].calls, sorted[i].ticks);
+        if (dladdr(sorted[i].fn, &info) && info.dli_sname) {
+            fprintf(out, "%s\n", info.dli_sname);
+        } else if (info.dli_fbase) {
+            fprintf(out, "%s+%#lx\n", info.dli_fname,
+                    (uintptr_t)sorted[i].fn - (uintptr_t)info.dli_fbase);
+        } else {
+            fprintf(out, "%p\n", sorted[i].fn);
+        }
+    }
+    if (dropped) {
+        fprintf(out, "%lu calls not recorded\n", dropped);
+    }
+    free(sorted);
+    if (out != stderr) {
+        fclose(out);
+    }
+}
@@ -0,0 +1,297 @@
+// Compile server and its client.
+//
+//   ncc --server SOCKET
+//
+// listens on a Unix domain socket and compiles the requests of any
+// number of clients, each connection on a thread of its own. Every
+// request is a compilation like any other, which releases its memory
+// when it ends, so the server does not grow however long it runs.
+//
+//   ncc --client SOCKET <arguments of ncc>
+//
+// is a drop-in replacement for ncc that leaves the compilation to the
+// server. The client reads the inputs and writes the outputs and the
+// diagnostics itself. The files named by -fprofile-use= and -fcache-dir=
+// are opened by the server, so the client makes relative paths in them
+// absolute, and passes its NCC_CACHE_DIR on as -fcache-dir=. Paths are
+// thus those of the client, provided the server sees the same files.
+// The path of -fprofile-generate= is opened by the compiled program.
+//
+// Requests and responses are sequences of fields. A field is a 32-bit
+// length in host byte order followed by that many bytes.
+//
+//   request:  filename, flags each terminated by NUL, source
+//   response: status ("ok" or "error"), assembly, diagnostics
+#include "ncc.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Largest field of a request, which is far more than any real source
+// needs. It bounds what a client can make the server allocate.
+#define MAX_REQUEST_FIELD (16 << 20)
+
+// Largest field of a response
+#define MAX_RESPONSE_FIELD (1 << 30)
+
+// Options whose paths the server opens
+static char *path_options[] = {"-fprofile-use=", "-fcache-dir="};
+
+static bool write_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_field(int fd, char *data, size_t len) {
+    uint32_t len32 = len;
+    return write_all(fd, (char *)&len32, sizeof(len32)) && write_all(fd, data, len);
+}
+
+// Receives a field of at most `max` bytes into a NUL-terminated buffer
+// from malloc, or returns NULL at the end of the stream or on an error
+static char *recv_field(int fd, size_t max, size_t *len) {
+    uint32_t len32;
+    if (!read_all(fd, (char *)&len32, sizeof(len32)) || len32 > max) {
+        return NULL;
+    }
+    char *buf = malloc(len32 + 1);
+    if (!read_all(fd, buf, len32)) {
+        free(buf);
+        return NULL;
+    }
+    buf[len32] = '\0';
+    *len = len32;
+    return buf;
+}
+
+static struct sockaddr_un socket_address(char *path) {
+    struct sockaddr_un addr = {};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error("socket path too long: %s", path);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+// Compiles one request of a connection. Returns false when the client
+// has no more requests.
+static bool serve_request(int fd) {
+    size_t name_len, flags_len, src_len;
+    char *name = recv_field(fd, MAX_REQUEST_FIELD, &name_len);
+    char *flags = name ? recv_field(fd, MAX_REQUEST_FIELD, &flags_len) : NULL;
+    char *src = flags ? recv_field(fd, MAX_REQUEST_FIELD, &src_len) : NULL;
+    if (!src) {
+        free(name);
+        free(flags);
+        return false;
+    }
+
+    // Split the flags at their terminators
+    int nflags = 0;
+    for (size_t i = 0; i < flags_len; i++) {
+        nflags += flags[i] == '\0';
+    }
+    char **argv = calloc(nflags + 1, sizeof(char *));
+    for (size_t i = 0, n = 0; n < nflags; i += strlen(flags + i) + 1) {
+        argv[n++] = flags + i;
+    }
+
+    Context c = {};
+    c.filename = name;
+    c.source = src;
+    c.source_len = src_len;
+    c.flags = argv;
+
+    char *out, *diag;
+    size_t out_len, diag_len;
+    c.out = open_memstream(&out, &out_len);
+    c.diag = open_memstream(&diag, &diag_len);
+    bool ok = compile(&c);
+    fclose(c.out);
+    fclose(c.diag);
+
+    char *status = ok ? "ok" : "error";
+    bool sent = send_field(fd, status, strlen(status)) &&
+                send_field(fd, out, out_len) && send_field(fd, diag, diag_len);
+
+    free(out);
+    free(diag);
+    free(argv);
+    free(name);
+    free(flags);
+    free(src);
+    return sent;
+}
+
+static void *serve_connection(void *arg) {
+    int fd = (intptr_t)arg;
+    while (serve_request(fd)) {
+    }
+    close(fd);
+    return NULL;
+}
+
+void serve(char *path) {
+    struct sockaddr_un addr = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("socket: %s", strerror(errno));
+    }
+
+    // A socket left behind by an earlier server is replaced
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        error("cannot listen on %s: %s", path, strerror(errno));
+    }
+
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            error("accept: %s", strerror(errno));
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)conn)) {
+            close(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Reads an input of the client, or returns NULL if it cannot be read
+static char *load_input(char *path, size_t *len) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fp) {
+        return NULL;
+    }
+
+    char *buf;
+    FILE *out = open_memstream(&buf, len);
+    char buf2[4096];
+    size_t n;
+    while ((n = fread(buf2, 1, sizeof(buf2), fp)) > 0) {
+        fwrite(buf2, 1, n, out);
+    }
+    fclose(out);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return buf;
+}
+
+// Writes an option that takes a path, with a relative path made absolute
+static void write_path_flag(FILE *fp, char *option, char *path) {
+    char cwd[PATH_MAX];
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+        fprintf(fp, "%s%s/%s", option, cwd, path);
+    } else {
+        fprintf(fp, "%s%s", option, path);
+    }
+    fputc('\0', fp);
+}
+
+static void write_flag(FILE *fp, char *flag) {
+    for (int i = 0; i < sizeof(path_options) / sizeof(*path_options); i++) {
+        int len = strlen(path_options[i]);
+        if (!strncmp(flag, path_options[i], len)) {
+            write_path_flag(fp, path_options[i], flag + len);
+            return;
+        }
+    }
+    fwrite(flag, 1, strlen(flag) + 1, fp);
+}
+
+// Has the server at `path` compile the input of `c`, and writes the
+// results to the streams of `c` as compile() would
+bool compile_remote(Context *c, char *path) {
+    size_t src_len;
+    char *src = load_input(c->filename, &src_len);
+    if (!src) {
+        fprintf(c->diag, "cannot open %s: %s\n", c->filename, strerror(errno));
+        return false;
+    }
+    if (src_len > MAX_REQUEST_FIELD) {
+        fprintf(c->diag, "%s: too large for the server\n", c->filename);
+        free(src);
+        return false;
+    }
+
+    char *flags;
+    size_t flags_len;
+    FILE *fp = open_memstream(&flags, &flags_len);
+    bool has_cache_dir = false;
+    for (char **flag = c->flags; flag && *flag; flag++) {
+        write_flag(fp, *flag);
+        has_cache_dir |= !strncmp(*flag, "-fcache-dir=", 12);
+    }
+    // The environment of the server is not that of the client
+    char *cache_dir = getenv("NCC_CACHE_DIR");
+    if (!has_cache_dir && cache_dir) {
+        write_path_flag(fp, "-fcache-dir=", cache_dir);
+    }
+    fclose(fp);
+
+    struct sockaddr_un addr = socket_address(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool ok = false;
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(c->diag, "cannot connect to %s: %s\n", path, strerror(errno));
+    } else if (send_field(fd, c->filename, strlen(c->filename)) &&
+               send_field(fd, flags, flags_len) && send_field(fd, src, src_len)) {
+        size_t status_len, out_len, diag_len;
+        char *status = recv_field(fd, MAX_RESPONSE_FIELD, &status_len);
+        char *out = status ? recv_field(fd, MAX_RESPONSE_FIELD, &out_len) : NULL;
+        char *diag = out ? recv_field(fd, MAX_RESPONSE_FIELD, &diag_len) : NULL;
+        if (diag) {
+            fwrite(out, 1, out_len, c->out);
+            fwrite(diag, 1, diag_len, c->diag);
+            ok = !strcmp(status, "ok");
+        } else {
+            fprintf(c->diag, "%s: connection to the server lost\n", c->filename);
+        }
+        free(status);
+        free(out);
+        free(diag);
+    } else {
+        fprintf(c->diag, "%s: cannot send to the server\n", c->filename);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(flags);
+    free(src);
+    return ok;
+}
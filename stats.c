@@ -0,0 +1,138 @@
+// Compile-time statistics for -ftime-report and -fstats.
+//
+// Each phase of the compiler accumulates the wall-clock and CPU time
+// spent in it. Phases nest: starting a phase inside another pauses the
+// outer one, so every moment is charged to exactly one phase and the
+// times add up to the total. The timers do nothing unless a report was
+// requested.
+#include "ncc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAX_PHASE_DEPTH 16
+
+_Thread_local Stats stats;
+
+static char *phase_names[] = {
+    [PH_READ] = "read",
+    [PH_LEX] = "lex",
+    [PH_KEYWORDS] = "keywords",
+    [PH_PARSE] = "parse",
+    [PH_TYPES] = "types",
+    [PH_PROFILE] = "profile",
+    [PH_INLINE] = "inline",
+    [PH_LOOPS] = "loops",
+    [PH_CSE] = "cse",
+    [PH_WHOLE_PROGRAM] = "whole-program",
+    [PH_LAYOUT] = "layout",
+    [PH_EMIT] = "emit",
+    [PH_PEEPHOLE] = "peephole",
+};
+
+typedef struct {
+    double wall;
+    double cpu;
+} Times;
+
+static _Thread_local Times phase_times[NUM_PHASES];
+
+static _Thread_local Phase phase_stack[MAX_PHASE_DEPTH];
+static _Thread_local int phase_depth;
+static _Thread_local Times phase_start;
+
+static double seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Times now(void) {
+    return (Times){seconds(CLOCK_MONOTONIC), seconds(CLOCK_PROCESS_CPUTIME_ID)};
+}
+
+// Charges the time since the last switch to the running phase
+static void charge(Times t) {
+    if (phase_depth > 0) {
+        Times *p = &phase_times[phase_stack[phase_depth - 1]];
+        p->wall += t.wall - phase_start.wall;
+        p->cpu += t.cpu - phase_start.cpu;
+    }
+    phase_start = t;
+}
+
+void phase_begin(Phase phase) {
+    if (!opt_time_report && !opt_stats_json) {
+        return;
+    }
+    if (phase_depth == MAX_PHASE_DEPTH) {
+        error("phases nested too deeply");
+    }
+    charge(now());
+    phase_stack[phase_depth++] = phase;
+}
+
+void phase_end(void) {
+    if (!opt_time_report && !opt_stats_json) {
+        return;
+    }
+    charge(now());
+    phase_depth--;
+}
+
+// Returns the peak resident set size in kilobytes
+static long peak_rss(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void print_text(FILE *out) {
+    Times total = {};
+    for (int i = 0; i < NUM_PHASES; i++) {
+        total.wall += phase_times[i].wall;
+        total.cpu += phase_times[i].cpu;
+    }
+
+    fprintf(out, "%-16s %10s %10s %6s\n", "phase", "wall (ms)", "cpu (ms)", "%");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        Times *t = &phase_times[i];
+        fprintf(out, "%-16s %10.3f %10.3f %6.1f\n", phase_names[i], t->wall * 1e3,
+                t->cpu * 1e3, total.wall > 0 ? t->wall / total.wall * 100 : 0);
+    }
+    fprintf(out, "%-16s %10.3f %10.3f\n", "total", total.wall * 1e3, total.cpu * 1e3);
+
+    fprintf(out, "\n");
+    fprintf(out, "%-16s %10ld\n", "bytes", stats.bytes);
+    fprintf(out, "%-16s %10ld\n", "lines", stats.lines);
+    fprintf(out, "%-16s %10ld\n", "tokens", stats.tokens);
+    fprintf(out, "%-16s %10ld\n", "nodes", stats.nodes);
+    fprintf(out, "%-16s %10ld\n", "types", stats.types);
+    fprintf(out, "%-16s %10ld\n", "lookups", stats.lookups);
+    fprintf(out, "%-16s %10ld\n", "instructions", stats.insts);
+    fprintf(out, "%-16s %10ld\n", "peak rss (kB)", peak_rss());
+}
+
+static void print_json(FILE *out) {
+    fprintf(out, "{\"phases\": {");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+                i ? ", " : "", phase_names[i], phase_times[i].wall * 1e3,
+                phase_times[i].cpu * 1e3);
+    }
+    fprintf(out, "}, \"counters\": {");
+    fprintf(out, "\"bytes\": %ld, \"lines\": %ld, \"tokens\": %ld, ", stats.bytes,
+            stats.lines, stats.tokens);
+    fprintf(out, "\"nodes\": %ld, \"types\": %ld, \"lookups\": %ld, ", stats.nodes,
+            stats.types, stats.lookups);
+    fprintf(out, "\"instructions\": %ld, \"peak_rss_kb\": %ld}}\n", stats.insts,
+            peak_rss());
+}
+
+void print_stats(FILE *out) {
+    if (opt_time_report) {
+        print_text(out);
+    }
+    if (opt_stats_json) {
+        print_json(out);
+    }
+}
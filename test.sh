@@ -12,8 +12,9 @@ EOF
 assert() {
   expected="$1"
   input="$2"
+  flags="$3"
 
-  echo "$input" | ./ncc - > tmp.s || exit
+  echo "$input" | ./ncc $flags - > tmp.s || exit
   #gcc -static -o tmp tmp.s tmp2.o
   gcc -o tmp tmp.s
   ./tmp
@@ -174,6 +175,20 @@ assert 98 'int main() { return "abc"[1]; }'
 assert 99 'int main() { return "abc"[2]; }'
 assert 0 'int main() { return "abc"[3]; }'
 assert 4 'int main() { return sizeof("abc"); }'
+assert 1 'int main() { char *a; char *b; a = "abc"; b = "abc"; return a == b; }'
+assert 1 'int main() { char *a; char *b; a = "abc"; b = "bc"; return a + 1 == b; }'
+assert 99 'int main() { char *a; char *b; a = "a\0bc"; b = "bc"; return a[3] + b[2]; }'
+
+assert 13 'int x = 3 * 4 + 1; int main() { return x; }'
+assert 44 'char c = 300; int main() { return c; }'
+assert 21 'const int sq[5] = {0, 1, 4, 9, 16,}; int m[2][3] = {{1, 2, 3}, {4, 5}}; int main() { return sq[4] + m[1][1] + m[1][2]; }'
+assert 18 'int x = 9; int a[4] = {1, 2, 3, 4}; int *p = &x; int *q = a + 2; int *r = &a[3]; int main() { return *p + *q + *r + (q - a); }'
+assert 216 'char *names[3] = {"zero", "one", "two"}; const char *msg = "hi"; char s[8] = "hi"; char t[2] = "hey"; int main() { return names[2][1] - msg[0] + s[1] + t[1] - s[2] - 5; }'
+assert 50 'int unused[3] = {7, 8, 9}; int hidden = 42; int *tab[2] = {&hidden, unused + 1}; int main() { return *tab[0] + *tab[1]; }' -fwhole-program
+assert 50 'int unused[3] = {7, 8, 9}; int hidden = 42; int *tab[2] = {&hidden, unused + 1}; int main() { return *tab[0] + *tab[1]; }' -fno-unit-at-a-time
+assert 121 'const char *msg = "hi"; int main() { msg = "yo"; return msg[0]; }'
+assert 104 'int main() { const char *m; m = "hi"; return m[0]; }'
+assert 106 'int f(const int x) { const int y = x + 1; return y; } char *const p = "abc"; int main() { return f(6) + p[2]; }'
 
 assert 0 'int main() { return "\0"[0]; }'
 assert 16 'int main() { return "\20"[0]; }'
@@ -185,4 +200,296 @@ assert 119 'int main() { return "\x77"[0]; }'
 assert 165 'int main() { return "\xA5"[0]; }'
 assert 255 'int main() { return "\x00ff"[0]; }'
 
+assert 4 'int main() { int a=1; int b=0; if (a) { if (b) return 3; else return 4; } else return 5; return 6; }'
+assert 6 'int main() { int i=0; int j=0; while (i<3) { if (i) j=j+i; else j=j+3; i=i+1; } return j; }'
+assert 21 'int add6(int a, int b, int c, int d, int e, int f) { return a+b+c+d+e+f; } int main() { return add6(1,2,3,4,5,6); }' -fno-peephole
+assert 3 'int main() { int x; x=0; 1; 2; x=3; return x; }' -O0
+
+assert 2 'int main() { int x=2; { int x=3; } return x; }'
+assert 2 'int main() { int x=2; { int x=3; } { int y=4; } return x; }'
+assert 7 'int main() { int x=2; { int y=3; x=x+y; } { int z=2; x=x+z; } return x; }'
+assert 3 'int main() { char c=1; int x=2; char d=0; return c+x+d; }'
+assert 6 'int f(int a, char b, int c) { char d=b; return a+d+c; } int main() { return f(1, 2, 3); }'
+assert 6 'int f(int a, char b, int c) { char d=b; return a+d+c; } int main() { return f(1, 2, 3); }' -fno-omit-frame-pointer
+
+assert 1 'int f(int n, int acc) { if (n == 0) return acc; return f(n-1, acc+1); } int main() { return f(1000000, 0) == 1000000; }'
+assert 1 'int even(int n) { if (n == 0) return 1; return odd(n-1); } int odd(int n) { if (n == 0) return 0; return even(n-1); } int main() { return even(1000000); }'
+assert 7 'int g(int x) { return x; } int f(int x) { return g(x); } int main() { return f(7); }'
+assert 9 'int g(int *p) { return *p; } int f(int x) { return g(&x); } int main() { return f(9); }'
+assert 55 'int fib(int n) { if (n <= 1) return n; return fib(n-1) + fib(n-2); } int main() { return fib(10); }'
+
+assert 11 'int sq(int x) { return x*x; } int add(int a, int b) { int t; t = a + b; return t; } int get(int *p, int i) { return p[i]; } int main() { int a[3]; a[0]=1; a[1]=2; a[2]=3; return add(sq(2), add(get(a, 2), sq(add(1, 1)))); }'
+assert 11 'int sq(int x) { return x*x; } int add(int a, int b) { int t; t = a + b; return t; } int get(int *p, int i) { return p[i]; } int main() { int a[3]; a[0]=1; a[1]=2; a[2]=3; return add(sq(2), add(get(a, 2), sq(add(1, 1)))); }' -finline-limit=0
+assert 10 'int add(int a, int b) { return a + b; } int main() { int x=1; int y=2; x = add(add(x, y), add(y, x)); { int z=4; x = x + add(z, 0); } return x; }'
+assert 7 'int one() { return 1; } int id(int x) { int y=x; return y; } int sub3(int a, int b, int c) { if (a == 0) return b-c; return sub3(a-1, b, c); } int main() { return sub3(one(), id(9), 2); }'
+assert 3 'int trunc(char c) { return c; } int main() { return trunc(259); }'
+assert 120 'int fact(int n) { if (n <= 1) return 1; return n * fact(n-1); } int twice(int n) { return fact(n); } int main() { return twice(5); }'
+assert 6 'int abs(int x) { int r; r = x; if (x < 0) r = -x; return r; } int main() { return abs(-3) + abs(3); }'
+
+assert 30 'int main() { int x[3][4]; int i; int j; int s=0; for (j=0; j<3; j=j+1) for (i=0; i<4; i=i+1) x[j][i]=i+j; for (j=0; j<3; j=j+1) for (i=0; i<4; i=i+1) s=s+x[j][i]; return s; }'
+assert 30 'int main() { int x[3][4]; int i; int j; int s=0; for (j=0; j<3; j=j+1) for (i=0; i<4; i=i+1) x[j][i]=i+j; for (j=0; j<3; j=j+1) for (i=0; i<4; i=i+1) s=s+x[j][i]; return s; }' '-fno-ivopts -fno-move-loop-invariants'
+assert 45 'int a[10]; int b[10]; int main() { int i; int s=0; for (i=0; i<10; i=i+1) { a[i]=i; b[i]=2*i; } for (i=9; i>=0; i=i-1) a[i]=b[i]-a[i]; for (i=0; i<10; i=i+1) s=s+a[i]; return s; }'
+assert 12 'int main() { int n=3; int m=4; int i; int s=0; for (i=0; i<n*m; i=i+1) s=s+1; return s; }'
+assert 7 'int main() { char c[8]; int i; int k=3; for (i=0; i<8; i=i+1) { c[i]=k*2+1; k=k+0; } return c[7]; }'
+assert 6 'int main() { int a[4]; int *p=a; int i; for (i=0; i<4; i=i+1) { a[i]=i; } int s=0; for (i=0; i<4; i=i+1) { s=s+*p; p=p+1; } return s; }'
+assert 3 'int f() { return 1; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(); return s; }' -finline-limit=0
+
+assert 36 'int main() { int a[8]; int i; int s=0; for (i=0; i<8; i=i+1) a[i]=i+1; for (i=0; i<8; i=i+1) s=s+a[i]; return s; }'
+assert 53 'int main() { int i; int s=0; for (i=1; i<=7; i=i+2) { int t; t=i*2; s=s+t; } return s+i+12; }'
+assert 28 'int f(int n) { int i; int s=0; for (i=0; i<n; i=i+1) s=s+i; return s+i; } int main() { return f(7); }'
+assert 28 'int f(int n) { int i; int s=0; for (i=0; i<n; i=i+1) s=s+i; return s+i; } int main() { return f(7); }' -fno-unroll-loops
+assert 20 'int main() { int i; int s=0; for (i=20; i>1; i=i-3) s=s+1; return s*3+i; }'
+assert 55 'int main() { int i; int s=0; for (i=0; i<10; i=i+1) s=s+i; return s+i; }' -funroll-limit=0
+assert 6 'int main() { int i; for (i=0; i<100; i=i+1) if (i*i > 30) return i; return 0; }'
+assert 5 'int main() { int i; int s=0; for (i=5; i<3; i=i+1) s=s+1; return s+i; }'
+
+assert 40 'char a[40]; char b[40]; int main() { int i; int s=0; for (i=0; i<40; i=i+1) { a[i]=i; b[i]=3; } for (i=0; i<37; i=i+1) a[i] = a[i] + b[i] - 1; for (i=0; i<37; i=i+1) s = s + a[i]; return s - 700; }'
+assert 40 'char a[40]; char b[40]; int main() { int i; int s=0; for (i=0; i<40; i=i+1) { a[i]=i; b[i]=3; } for (i=0; i<37; i=i+1) a[i] = a[i] + b[i] - 1; for (i=0; i<37; i=i+1) s = s + a[i]; return s - 700; }' -fno-tree-vectorize
+assert 163 'char a[50]; int main() { int i; int s=0; for (i=0; i<50; i=i+1) a[i]=i*11; for (i=0; i<50; i=i+1) s = s + a[i]; return s; }'
+assert 21 'char a[50]; char b[50]; int main() { int i; int n=45; int s=0; for (i=0; i<n; i=i+1) { a[i]=i/7; b[i]=i/6; } for (i=0; i<n; i=i+1) s = s + (a[i] == b[i]); return s; }'
+assert 40 'char a[40]; int main() { int i; int s=0; for (i=0; i<40; i=i+1) a[i]=1; for (i=1; i<40; i=i+1) a[i] = a[i-1] + 1; return a[39]; }'
+assert 33 'int cpy(char *p, char *q, int n) { int i; for (i=0; i<n; i=i+1) p[i] = q[i]; return 0; } char a[40]; int main() { int i; for (i=0; i<40; i=i+1) a[i]=i; cpy(a+3, a, 30); return a[33] - a[30] + a[3]; }'
+assert 26 'int cpy(char *p, char *q, int n) { int i; for (i=0; i<n; i=i+1) p[i] = q[i]; return 0; } char a[40]; char b[40]; int main() { int i; for (i=0; i<40; i=i+1) a[i]=i; cpy(b, a, 30); return b[26]; }'
+assert 81 'int x[20]; int main() { int i; int s=0; for (i=0; i<20; i=i+1) x[i]=i; for (i=0; i<19; i=i+1) x[i] = x[i+1] - 5; for (i=0; i<18; i=i+1) s = s + x[i]; return s; }'
+
+assert 5 'int main() { int a[10]; int *p=a+7; int *q=a+2; return p-q; }'
+assert 251 'int main() { int a[10]; int *p=a+7; int *q=a+2; return q-p+256; }'
+assert 7 'int main() { int x=-15; return -x/2; }'
+assert 250 'int main() { int x=-15; return x/2 + x*-3/7 + 256 - 5; }'
+
+assert 9 'int a[10]; int b[10]; int main() { int i=3; a[i]=5; b[i]=4; a[i] = a[i] + b[i]; return a[i]; }'
+assert 9 'int a[10]; int b[10]; int main() { int i=3; a[i]=5; b[i]=4; a[i] = a[i] + b[i]; return a[i]; }' -fno-cse
+assert 10 'int main() { int x=1; int *p=&x; int y=x*2+3; *p=2; return y + x*2+3 - 2; }'
+assert 12 'int g; int inc() { g = g + 1; return 0; } int main() { g=1; int a=g*3+g; inc(); return a + g*3+g; }'
+assert 27 'int a[4]; int main() { int *p=a; a[1]=2; int x=a[1]*3; p[1]=7; return x + a[1]*3; }'
+assert 7 'int a[4]; int main() { a[2]=3; a[3]=4; int i=1; int x=a[i+1]; i=2; return x + a[i+1]; }'
+assert 16 'int a[10]; int main() { int c; int x; int y; c=0; x=0; y=0; a[2]=5; if (c) x = a[2]*3+1; else y = a[2]*3+1; return y; }'
+assert 40 'int main() { int c; int x; int y; int z; c=0; x=0; y=0; z=5; if (c) x = z*3+z*5; else y = z*3+z*5; return y; }'
+assert 7 'int a[10]; int main() { int i; int n; int x; a[0]=1; a[1]=1; a[2]=2; n=2; for (i=0; i<n; i=i+1) x = a[i]*3+1; return a[i]*3+1; }' '-O0 -fcse'
+assert 4 'int a[10]; int main() { int i; int n; int x; a[2]=1; n=0; for (i=0; i<n; i=i+1) x = a[2]*3+1; return a[2]*3+1; }' '-O0 -fcse'
+assert 4 'int a[10]; int main() { int i; int n; int x; a[2]=1; i=0; n=0; while (i<n) x = a[2]*3+1; return a[2]*3+1; }' '-O0 -fcse'
+
+assert 3 'int unused() { return nosuch(); } int main() { return 3; }' -fwhole-program
+assert 5 'int g; int h[100]; int dead() { return h[1] + nosuch(); } int two() { return 2; } int three() { return 3; } int main() { g = two() + three(); return g; }' '-fwhole-program -fno-inline'
+assert 4 'int sq(int x) { return x*x; } int main() { char *s = "ab"; return sq(2); }' -fwhole-program
+
+assert 99 'int g; char *s; int f() { s = "abc"; return 1; } char c[3]; int main() { g = f(); c[1] = 97; return s[g] + g - c[1] + 97; }' -fno-unit-at-a-time
+assert 12 'int sum(int n) { int i; int s; s = 0; for (i = 0; i < n; i = i + 1) s = s + i; return s; } int main() { return sum(4) + sum(3) + 3; }' '-fno-unit-at-a-time -g'
+
+assert 9 'int main() { int i; i = 0; for (;;) { i = i + 1; if (i == 9) return i; } }'
+assert 45 'int main() { int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) s = s + i; return s; }' -fno-reorder-blocks
+assert 3 'int main() { int x; x = 3; if (__builtin_expect(x == 4, 0)) exit(9); return x; }'
+assert 9 'int main() { int x; x = 4; if (__builtin_expect(x == 4, 0)) exit(9); return x; }'
+assert 109 'int main() { int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) { if (__builtin_expect(i == 5, -1)) s = s + 100; else s = s + 1; if (i > 20) abort(); } return s; }'
+assert 7 'int f(int x) { if (x < 0) { exit(7); } return x; } int main() { return f(2) + f(-1); }' -fno-inline
+assert 2 'int f(int x) { if (x < 0) { exit(7); } else { return x; } return 0; } int main() { return f(2); }' -fno-reorder-blocks-and-partition
+assert 7 'int deep(int a) { return a + 1; } int leaf(int a, int b) { int x; x = a * b + (a - b) * (a + b); return x; } int f(int n) { if (n > 1000) { if (n > 2000) exit(3); exit(4); } return leaf(n, 2) + deep(n); } int main() { return f(5) - 30; }' '-g -fno-inline'
+assert 5 'int g(int x) { return x + 1; } int f(int x) { if (x) return g(x); return 0; } int main() { return f(4); }' '-g -fno-inline'
+
+# Multiplication and division by a constant must agree with imul and idiv,
+# which are used when the same number comes from a variable.
+muldiv_sweep() {
+  consts="$(seq -300 300 | grep -vx 0)"
+  for k in $(seq 9 30); do
+    consts="$consts $((1 << k)) $((-(1 << k))) $(((1 << k) - 1)) $(((1 << k) + 1)) $(((1 << k) * 3 / 2))"
+  done
+  consts="$consts 1000000007 2147483647 -2147483647 123456789 -987654321"
+
+  echo 'int chk(int x) { int d;'
+  i=1
+  for c in $consts; do
+    echo "d=$c; if (x/$c != x/d) return $i; if (x*$c != x*d) return $i;"
+    i=$((i + 1))
+  done
+  echo 'return 0; }'
+  cat <<'EOF'
+int main() { int x; int i; int big; int r;
+  for (x=-3000; x<=3000; x=x+1) { r = chk(x); if (r) return 1; }
+  big = 1;
+  for (i=0; i<62; i=i+1) {
+    big = big*2;
+    r = chk(big) + chk(big-1) + chk(big+1) + chk(-big) + chk(1-big) + chk(-1-big);
+    if (r) return 2;
+  }
+  r = chk(big*2-1); if (r) return 3;
+  x = 1;
+  for (i=0; i<20000; i=i+1) { x = x*1103515245 + 12345; r = chk(x); if (r) return 4; }
+  return 0; }
+EOF
+}
+
+muldiv_sweep | ./ncc - > tmp.s || exit
+gcc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 0 ]; then
+  echo "mul/div by constants sweep => 0 expected, but got $actual"
+  exit 1
+fi
+echo "mul/div by constants sweep => 0"
+
+# Two instrumented runs, then a build that uses their merged profile
+pgo_input='int sq(int x) { return x*x; } int f(int x) { int s; int i; s = 0; for (i = 0; i < x; i = i + 1) { if (i == 3) s = s + 100; else s = s + sq(i); } return s; } int main() { int t; int k; t = 0; for (k = 0; k < 3; k = k + 1) t = t + f(k + 5); if (t > 10000) abort(); return t - 300; }'
+rm -f tmp.prof
+echo "$pgo_input" | ./ncc -fprofile-generate=tmp.prof - > tmp.s || exit
+gcc -o tmp tmp.s
+./tmp; ./tmp
+if [ "$(./ncc --dump-profile tmp.prof | grep '^sq ' | cut -d' ' -f4)" != 30 ]; then
+  echo "profile of two runs => sq called 30 times expected"
+  exit 1
+fi
+assert 149 "$pgo_input" -fprofile-use=tmp.prof
+echo "profile-guided optimization => 149"
+
+# Call counts from the instrumentation runtime
+echo 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(15) - 600; }' |
+  ./ncc -finstrument-functions - > tmp.s || exit
+gcc -rdynamic -o tmp tmp.s runtime/libnccrt.a
+NCC_INSTRUMENT_REPORT=tmp.report ./tmp
+if [ "$?" != 10 ] || ! grep -Eq '^ +1973 +[0-9]+  fib$' tmp.report; then
+  echo "-finstrument-functions => fib called 1973 times expected"
+  exit 1
+fi
+echo "-finstrument-functions => 1973 calls"
+assert 10 'int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(15) - 600; }' -pg
+
+# Counters of the statistics report
+json=$(echo 'int main() { return 0; }' | ./ncc -fstats=json - 2>&1 >/dev/null)
+if ! echo "$json" | grep -q '"lines": 1, "tokens": 10, "nodes": 3'; then
+  echo "-fstats=json => 1 line, 10 tokens and 3 nodes expected, but got $json"
+  exit 1
+fi
+echo "-fstats=json => 10 tokens"
+
+# Several translation units on two threads; an error fails only its unit
+dir=$(mktemp -d)
+echo 'int f(int x) { return x * 6; }' > $dir/a.c
+echo 'int main() { return f(7); }' > $dir/b.c
+echo 'int g() { return 1 +; }' > $dir/c.c
+if ./ncc -j 2 $dir/a.c $dir/b.c $dir/c.c 2>/dev/null || [ -f $dir/c.s ]; then
+  echo "-j 2 => a failure for c.c expected"
+  exit 1
+fi
+gcc -o tmp $dir/a.s $dir/b.s
+./tmp
+actual="$?"
+rm -rf $dir
+if [ "$actual" != 42 ]; then
+  echo "-j 2 => 42 expected, but got $actual"
+  exit 1
+fi
+echo "-j 2 => 42"
+
+# Compiling in-process through libncc, with errors passed to a callback
+dir=$(mktemp -d)
+cat > $dir/host.c <<'EOF'
+#include <stdio.h>
+#include <string.h>
+#include "libncc.h"
+static int errors;
+static void count(const char *msg, void *arg) { errors++; }
+int main() {
+  NccOptions opts = {"bad.c", NULL, count, NULL};
+  NccOutput out;
+  char *bad = "int main() { return 1 +; }";
+  char *good = "int main() { return 42; }";
+  if (ncc_compile(bad, strlen(bad), &opts, &out) != -1 || errors != 1) return 1;
+  if (ncc_compile(good, strlen(good), NULL, &out)) return 1;
+  fwrite(out.data, 1, out.len, stdout);
+  return 0;
+}
+EOF
+gcc -I. -o $dir/host $dir/host.c libncc.a -pthread || exit
+$dir/host > tmp.s || { echo "ncc_compile => errors reported by callback expected"; exit 1; }
+rm -rf $dir
+gcc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$actual" != 42 ]; then
+  echo "ncc_compile => 42 expected, but got $actual"
+  exit 1
+fi
+echo "ncc_compile => 42"
+
+# Compiling through a compile server
+dir=$(mktemp -d)
+./ncc --server $dir/sock &
+server=$!
+for i in $(seq 50); do
+  [ -S $dir/sock ] && break
+  sleep 0.1
+done
+echo 'int main() { return 1 +; }' | ./ncc --client $dir/sock - > /dev/null 2>&1
+failed="$?"
+echo 'int main() { int x; x = 6; return x * 7; }' | ./ncc --client $dir/sock -O0 - > tmp.s
+ok="$?"
+kill $server
+rm -rf $dir
+gcc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$failed" != 1 ] || [ "$ok" != 0 ] || [ "$actual" != 42 ]; then
+  echo "--client => 42 expected, but got $actual"
+  exit 1
+fi
+echo "--client => 42"
+
+# A second compilation of the same source comes from the cache
+dir=$(mktemp -d)
+echo 'int main() { return 42; }' | ./ncc -fcache-dir=$dir - > tmp.s || exit
+echo 'int main() { return 42; }' | ./ncc -fcache-dir=$dir - > tmp2.s || exit
+hits=$(./ncc --cache-stats -fcache-dir=$dir | awk '$1 == "hits" { print $2 }')
+rm -rf $dir
+if [ "$hits" != 1 ] || ! cmp -s tmp.s tmp2.s; then
+  echo "-fcache-dir => 1 hit with the same output expected, but got $hits"
+  exit 1
+fi
+echo "-fcache-dir => 1 hit"
+
+# An entry larger than 1/256 of the cache is kept
+dir=$(mktemp -d)
+for i in $(seq 50); do echo "int f$i() { return $i; }"; done > tmp.c
+echo 'int main() { return 0; }' >> tmp.c
+./ncc -fcache-dir=$dir -fcache-max-size=1 -o tmp.s tmp.c || exit
+./ncc -fcache-dir=$dir -fcache-max-size=1 -o tmp.s tmp.c || exit
+hits=$(./ncc --cache-stats -fcache-dir=$dir | awk '$1 == "hits" { print $2 }')
+rm -rf $dir tmp.c
+if [ "$hits" != 1 ] || [ $(wc -c < tmp.s) -le 4096 ]; then
+  echo "-fcache-max-size=1 => 1 hit expected, but got $hits"
+  exit 1
+fi
+echo "-fcache-max-size=1 => 1 hit"
+
+# --watch recompiles only the functions that changed when the file is saved
+dir=$(mktemp -d)
+cat > $dir/w.c <<EOF
+int f() { return 40; }
+int g() { return 2; }
+int main() { return f() + g(); }
+EOF
+./ncc --watch $dir/w.c -o $dir/w.s 2> $dir/log &
+watcher=$!
+for i in $(seq 100); do
+  [ "$(grep -c recompiled $dir/log)" = 1 ] && break
+  sleep 0.1
+done
+sed -i 's/return 2;/return 3;/' $dir/w.c
+for i in $(seq 100); do
+  [ "$(grep -c recompiled $dir/log)" = 2 ] && break
+  sleep 0.1
+done
+kill $watcher
+recompiled=$(tail -1 $dir/log | grep -o '[0-9]* of [0-9]*')
+./ncc $dir/w.c > tmp2.s
+cp $dir/w.s tmp.s
+rm -rf $dir
+gcc -o tmp tmp.s
+./tmp
+actual="$?"
+if [ "$recompiled" != "2 of 3" ] || [ "$actual" != 43 ] || ! cmp -s tmp.s tmp2.s; then
+  echo "--watch => 2 of 3 functions recompiled and 43 expected, but got $recompiled and $actual"
+  exit 1
+fi
+echo "--watch => 2 of 3 recompiled"
+
 echo OK
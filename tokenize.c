@@ -1,26 +1,46 @@
 #include "ncc.h"
 #include <stdio.h>
 
-// Input filename
-static char *current_filename;
+// Prints an error message, or hands it to the callback of the
+// compilation
+static void report(char *msg) {
+    if (ctx && ctx->diagnostic) {
+        ctx->diagnostic(msg, ctx->diagnostic_arg);
+    } else {
+        fputs(msg, (ctx && ctx->diag) ? ctx->diag : stderr);
+    }
+    free(msg);
+}
 
-// Input string
-static char *current_input;
+// Abandons the current compilation, or exits if there is none
+static void fail(void) {
+    if (ctx && ctx->on_error) {
+        longjmp(*ctx->on_error, 1);
+    }
+    exit(1);
+}
 
 // Reports an error and exit
 void error(char *fmt, ...) {
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+    fprintf(out, "\n");
+    fclose(out);
+    report(buf);
+    fail();
 }
 
-// Reports an error location and exit
+// Reports a message with its location in the source
 static void verror_at(char *loc, char *fmt, va_list ap) {
     // `line` is pointer to the beginning character of the line
     char *line = loc;
-    while (current_input < line && line[-1] != '\n') {
+    while (ctx->input < line && line[-1] != '\n') {
         line--;
     }
     char *end = loc;
@@ -28,31 +48,46 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
         end++;
     }
     int line_no = 1;
-    for (char *p = current_input; p < line; p++) {
+    for (char *p = ctx->input; p < line; p++) {
         if (*p == '\n') {
             line_no++;
         }
     }
-    int ident = fprintf(stderr, "%s:%d: ", current_filename, line_no);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+
+    char *buf;
+    size_t buflen;
+    FILE *out = open_memstream(&buf, &buflen);
+    int ident = fprintf(out, "%s:%d: ", ctx->filename, line_no);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
     int pos = loc - line + ident;
-    fprintf(stderr, "%*s", pos, "");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    fprintf(out, "%*s", pos, "");
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    fclose(out);
+    report(buf);
 }
 
 void error_at(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(loc, fmt, ap);
+    fail();
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(tok->loc, fmt, ap);
+    fail();
+}
+
+// Reports a message about a token without stopping compilation
+void note_tok(Token *tok, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    verror_at(tok->loc, fmt, ap);
+    va_end(ap);
 }
 
 // Checks the current token if it matches `s`
@@ -87,7 +122,8 @@ static int get_number(Token *tok) {
 
 // Create a new token
 Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_calloc(1, sizeof(Token));
+    stats.tokens++;
     tok->kind = kind;
     tok->loc = start;
     tok->len = end - start;
@@ -109,7 +145,8 @@ static int read_punct(char *p) {
 
 static bool is_keyword(Token *tok) {
     char *keywords[] = {
-        "return", "if", "else", "for", "while", "int", "sizeof", "char"
+        "return", "if", "else", "for", "while", "int", "sizeof", "char",
+        "const"
     };
     for (int i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
         if (equal(tok, keywords[i]))
@@ -185,7 +222,7 @@ static char *string_literal_end(char *p) {
 
 static Token *read_string_literal(char *start) {
     char *end = string_literal_end(start + 1);
-    char *buf = calloc(1, end - start);
+    char *buf = arena_calloc(1, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
@@ -210,11 +247,39 @@ static void convert_keywords(Token *tok) {
     }
 }
 
-static Token *tokenize(char *filename, char *p) {
-    current_filename = filename;
-   current_input = p;
-   Token head = {};
-   Token *cur = &head;
+// Line number at the start of the next chunk of tokens
+static _Thread_local int chunk_line = 1;
+
+// Sets the line numbers of the tokens from `tok` up to the end of file
+// token, counting from line `n` at `p`, and returns the line number of
+// the end of file token
+static int add_line_numbers(Token *tok, char *p, int n) {
+    for (;; p++) {
+        if (p == tok->loc) {
+            tok->line_no = n;
+            if (tok->kind == TK_EOF) {
+                stats.lines += n - chunk_line;
+                return n;
+            }
+            tok = tok->next;
+        }
+        if (*p == '\n') {
+            n++;
+        }
+    }
+}
+
+// Tokenizes the input from `p`. If `one_decl` is true, tokenizing stops
+// at the end of the first top-level declaration, which is a ';' or a '}'
+// outside of braces, and `*rest` is set to the remaining input. Braces
+// after a '=' outside of braces enclose an initializer, so only a ';'
+// ends a declaration with one.
+static Token *tokenize(char **rest, char *p, bool one_decl) {
+    char *start = p;
+    Token head = {};
+    Token *cur = &head;
+    int depth = 0;
+    bool has_init = false;
 
     while (*p) {
         // Skip whitespace characters
@@ -225,8 +290,6 @@ static Token *tokenize(char *filename, char *p) {
 
         // Numeric Literals
         if (isdigit(*p)) {
-            // cur->next = new_token(TK_NUM, p, p);
-            // cur = cur->next;
             cur = cur->next = new_token(TK_NUM, p, p);
             char *q = p;
             cur->val = strtol(p, &p, 10);
@@ -254,10 +317,15 @@ static Token *tokenize(char *filename, char *p) {
         // Punctuator
         int punct_len = read_punct(p);
         if (punct_len) {
-            // cur->next = new_token(TK_PUNCT, p, p + 1);
-            // cur = cur->next;
             cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
             p += punct_len;
+            if (one_decl) {
+                depth += (*cur->loc == '{') - (*cur->loc == '}');
+                has_init |= depth == 0 && equal(cur, "=");
+                if (depth == 0 && (equal(cur, ";") || (equal(cur, "}") && !has_init))) {
+                    break;
+                }
+            }
             continue;
         }
 
@@ -265,7 +333,11 @@ static Token *tokenize(char *filename, char *p) {
     }
 
     cur = cur->next = new_token(TK_EOF, p, p);
+    *rest = p;
+    chunk_line = add_line_numbers(head.next, start, chunk_line);
+    phase_begin(PH_KEYWORDS);
     convert_keywords(head.next);
+    phase_end();
     return head.next;
 }
 
@@ -298,13 +370,58 @@ static char *read_file(char *path) {
         fclose(fp);
     }
     fflush(out);
-    if (buflen == 0 || buf[buflen - 1] == '\n') {
+    if (buflen == 0 || buf[buflen - 1] != '\n') {
         fputc('\n', out);
     }
     fclose(out);
-    return buf;
+
+    // Tokens point into the source, so it lives as long as they do
+    char *p = arena_strndup(buf, buflen);
+    free(buf);
+    return p;
 }
 
-Token *tokenize_file(char *path) {
-    return tokenize(path, read_file(path));
+// Copies `len` bytes of source in memory. The tokenizer expects the
+// input to end with a newline, as read_file ensures for files.
+static char *copy_source(char *src, size_t len) {
+    char *p = arena_calloc(1, len + 2);
+    memcpy(p, src, len);
+    if (len == 0 || p[len - 1] != '\n') {
+        p[len++] = '\n';
+    }
+    p[len] = '\0';
+    return p;
+}
+
+// Returns the source of the current compilation, from memory or from
+// its file
+char *read_input(void) {
+    phase_begin(PH_READ);
+    char *p;
+    if (ctx->source) {
+        p = copy_source(ctx->source, ctx->source_len);
+    } else {
+        p = read_file(ctx->filename);
+    }
+    stats.bytes += strlen(p);
+    ctx->input = p;
+    phase_end();
+    return p;
+}
+
+Token *tokenize_input(char *p) {
+    phase_begin(PH_LEX);
+    Token *tok = tokenize(&p, p, false);
+    phase_end();
+    return tok;
+}
+
+// Tokenizes the next top-level declaration of the input, and advances
+// `*p` past it. Returns the end of file token alone at the end of the
+// input.
+Token *tokenize_next_decl(char **p) {
+    phase_begin(PH_LEX);
+    Token *tok = tokenize(p, *p, true);
+    phase_end();
+    return tok;
 }
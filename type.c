@@ -1,57 +1,64 @@
 #include "ncc.h"
 
-Type *ty_int = &(Type){TY_INT, 8};
-Type *ty_char = &(Type){TY_CHAR, 1};
+Type *ty_int = &(Type){TY_INT, 8, 8};
+Type *ty_char = &(Type){TY_CHAR, 1, 1};
 
 bool is_integer(Type *ty) {
     return ty->kind == TY_INT || ty->kind == TY_CHAR;
 }
 
+static Type *new_type(TypeKind kind, int size, int align) {
+    Type *ty = arena_calloc(1, sizeof(Type));
+    ty->kind = kind;
+    ty->size = size;
+    ty->align = align;
+    stats.types++;
+    return ty;
+}
+
 Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = new_type(ty->kind, ty->size, ty->align);
     *ret = *ty;
     return ret;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
-    ty->size = 8;
+    Type *ty = new_type(TY_PTR, 8, 8);
     ty->base = base;
     return ty;
 }
 
 Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FUNC;
+    Type *ty = new_type(TY_FUNC, 0, 0);
     ty->return_ty = return_ty;
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_ARRAY;
-    ty->size = base->size * len;
+    Type *ty = new_type(TY_ARRAY, base->size * len, base->align);
     ty->base = base;
     ty->array_len = len;
     return ty;
 }
 
-void add_type(Node *node) {
+static void annotate(Node *node) {
     if (!node || node->ty) {
         return;
     }
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->update);
+    annotate(node->lhs);
+    annotate(node->rhs);
+    annotate(node->cond);
+    annotate(node->then);
+    annotate(node->els);
+    annotate(node->init);
+    annotate(node->update);
 
     for (Node *n = node->body; n; n = n->next) {
-        add_type(n);
+        annotate(n);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        annotate(n);
     }
 
     switch (node->kind) {
@@ -71,6 +78,7 @@ void add_type(Node *node) {
     case ND_LE:
     case ND_NUM:
     case ND_FUNCALL:
+    case ND_EXPECT:
         node->ty = ty_int;
         return;
     case ND_ADDR:
@@ -91,3 +99,9 @@ void add_type(Node *node) {
         return;
     }
 }
+
+void add_type(Node *node) {
+    phase_begin(PH_TYPES);
+    annotate(node);
+    phase_end();
+}
@@ -0,0 +1,83 @@
+// Whole-program optimization.
+//
+// When the translation unit is the whole program, only what `main`
+// reaches through calls, variable references and addresses in the
+// initializers of globals is needed. Everything
+// else is dropped, and the remaining objects are made local to the file.
+#include "ncc.h"
+
+// Global objects by name
+static _Thread_local HashMap objects;
+
+// Objects found reachable
+static _Thread_local HashMap reachable;
+
+static void mark_obj(Obj *obj);
+
+static void mark_node(Node *node) {
+    if (!node) {
+        return;
+    }
+
+    if (node->kind == ND_FUNCALL) {
+        Obj *fn = hashmap_get(&objects, node->funcname);
+        if (fn) {
+            mark_obj(fn);
+        }
+    } else if (node->kind == ND_VAR && !node->var->is_local) {
+        mark_obj(node->var);
+    }
+
+    mark_node(node->lhs);
+    mark_node(node->rhs);
+    mark_node(node->cond);
+    mark_node(node->then);
+    mark_node(node->els);
+    mark_node(node->init);
+    mark_node(node->update);
+    for (Node *n = node->body; n; n = n->next) {
+        mark_node(n);
+    }
+    for (Node *n = node->args; n; n = n->next) {
+        mark_node(n);
+    }
+}
+
+static void mark_obj(Obj *obj) {
+    if (hashmap_get(&reachable, obj->name)) {
+        return;
+    }
+    hashmap_put(&reachable, obj->name, obj);
+
+    if (obj->is_function) {
+        mark_node(obj->body);
+    }
+    for (Relocation *rel = obj->rel; rel; rel = rel->next) {
+        mark_obj(rel->var);
+    }
+}
+
+// Returns the objects reachable from `main`
+Obj *remove_unreachable(Obj *prog) {
+    hashmap_clear(&objects);
+    hashmap_clear(&reachable);
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        hashmap_put(&objects, obj->name, obj);
+    }
+
+    Obj *entry = hashmap_get(&objects, "main");
+    if (entry) {
+        mark_obj(entry);
+    }
+
+    Obj head = {};
+    Obj *cur = &head;
+    for (Obj *obj = prog; obj; obj = obj->next) {
+        if (hashmap_get(&reachable, obj->name)) {
+            obj->is_static = (obj != entry);
+            cur = cur->next = obj;
+        }
+    }
+    cur->next = NULL;
+    return head.next;
+}